@@ -528,10 +528,12 @@ void GraphClass::SingleVertexBoundedBreadthFirstVisit(unsigned aRootVertexIndex,
   }
 }
 
-vector<unsigned> GraphClass::GetFixedDistanceVertexIDList(unsigned aSrcID, int aDistance)const{
+const vector<unsigned>& GraphClass::GetFixedDistanceVertexIDList(unsigned aSrcID, int aDistance)const{
+  static const vector<unsigned> empty_list;
   if (mTopologicalChangeOccurrence==true) ComputePairwiseDistanceInformation(); 
-  if (mSrcDistanceMaptoDestList.count(make_pair(aSrcID,aDistance))==0) return vector<unsigned>(0);
-  else return mSrcDistanceMaptoDestList.find(make_pair(aSrcID,aDistance))->second;
+  map<pair<unsigned,int>,vector<unsigned> >::const_iterator it=mSrcDistanceMaptoDestList.find(make_pair(aSrcID,aDistance));
+  if (it==mSrcDistanceMaptoDestList.end()) return empty_list;
+  else return it->second;
 }
 int GraphClass::PairwiseDistance(unsigned aSrcID, unsigned aDestID)const{
   if (mTopologicalChangeOccurrence==true) ComputePairwiseDistanceInformation();
@@ -543,11 +545,11 @@ vector<unsigned> GraphClass::GetUnionShortestPathsVertexIDList(unsigned aSrcID,
   set<unsigned> union_shortest_paths_set;
   for (unsigned d=0;d<=aDistance;d++){
     //get all vertices at distance d from src 
-    vector<unsigned> src_neighbors=GetFixedDistanceVertexIDList(aSrcID, d);
+    const vector<unsigned>& src_neighbors=GetFixedDistanceVertexIDList(aSrcID, d);
     set<unsigned> src_neighbors_set;
     for (unsigned i=0;i<src_neighbors.size();i++) src_neighbors_set.insert(src_neighbors[i]);
     //get all vertices at distance aDistance-d from dest
-    vector<unsigned> dest_neighbors=GetFixedDistanceVertexIDList(aDestID, aDistance-d);
+    const vector<unsigned>& dest_neighbors=GetFixedDistanceVertexIDList(aDestID, aDistance-d);
     set<unsigned> dest_neighbors_set;
     for (unsigned i=0;i<dest_neighbors.size();i++) dest_neighbors_set.insert(dest_neighbors[i]);
     //store intersection set
@@ -574,7 +576,7 @@ set<unsigned> GraphClass::GetUnionThickShortestPathsVertexIDSet(unsigned aSrcID,
 vector<unsigned> GraphClass::GetNeighborhoodVertexIDList(unsigned aSrcID, unsigned aRadius)const{
   vector<unsigned> neighborhood;
   for (unsigned d=0;d<=aRadius;d++){
-    vector<unsigned> circle=GetFixedDistanceVertexIDList(aSrcID,d);
+    const vector<unsigned>& circle=GetFixedDistanceVertexIDList(aSrcID,d);
     for (unsigned i=0;i<circle.size();++i)
       neighborhood.push_back(circle[i]);
   }
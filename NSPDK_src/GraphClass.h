@@ -71,7 +71,7 @@ public:
   void SetEdgePartOf(unsigned aSrcID, unsigned aDestID, bool aStatus);
   bool Check()const;
   void ComputePairwiseDistanceInformation(int aMaxDistance=-1,int aMaxRadius=-1, vector<unsigned> aViewPointList=vector<unsigned>())const;
-  vector<unsigned> GetFixedDistanceVertexIDList(unsigned aSrcID, int aDistance)const;
+  const vector<unsigned>& GetFixedDistanceVertexIDList(unsigned aSrcID, int aDistance)const;
   int PairwiseDistance(unsigned aSrcID, unsigned aDestID)const;
   vector<unsigned> GetUnionShortestPathsVertexIDList(unsigned aSrcID, unsigned aDestID, unsigned aDistance)const;
   set<unsigned> GetUnionThickShortestPathsVertexIDSet(unsigned aSrcID, unsigned aDestID, unsigned aDistance, unsigned aThickness)const;
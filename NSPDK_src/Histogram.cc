@@ -20,6 +20,7 @@ void HistogramClass::Add(const HistogramClass& aH){
       Insert(bin,value);
     }
   }
+void HistogramClass::Clear(){mHistogram.clear();}
 ostream& HistogramClass::Output(ostream& out)const{
     for(map<unsigned,double>::const_iterator it=mHistogram.begin();it!=mHistogram.end();++it)
       out<<"      "<<it->first<<" : "<<it->second<<" ";
@@ -17,6 +17,7 @@ public:
   void Insert(unsigned aBin);
   void Insert(unsigned aBin, double aValue);
   void Add(const HistogramClass& aH);
+  void Clear();
   ostream& Output(ostream& out)const;
   unsigned Size()const;
 public:
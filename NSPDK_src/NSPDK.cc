@@ -10,6 +10,13 @@
 #include <list>
 #include <stdio.h>
 #include <omp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <cerrno>
+#include <csignal>
 
 using namespace std;
 
@@ -47,6 +54,8 @@ public:
 				mOutputAccuracy(false),
 				mOutputFeatureMap(false),
 				mOutputKernel(false),
+				mKernelMatrixFormat("text"),
+				mKernelMatrixMemoryMap(false),
 				mOutputApproximateKNN(false),
 				mOutputTrueKNN(false),
 				mOutputCluster(false),
@@ -72,6 +81,24 @@ public:
 				mSharedNeighbourhood(false),
 				mFullDensityEstimation(false),
 				mMaxRefinement(100000),
+				mNumRefinementChains(1),
+				mNumBands(0),
+				mNumRowsPerBand(0),
+				mBandThreshold(0),
+				mIndexFileName(""),
+				mKNNGraphFileName(""),
+				mNNDescentMaxIterations(10),
+				mCompressedValueBits(0),
+				mHugePages(false),
+				mAllPairsThreshold(0),
+				mDenseEmbeddingSize(0),
+				mDenseEmbeddingRerankFactor(0),
+				mServe(false),
+				mSocketFileName(""),
+				mWeightedMinHash(false),
+				mMaxScoreEarlyTermination(false),
+				mBoundPruning(false),
+				mKernelCacheMemory(1024),
 				mDebug(0),
 				mThreads(1){
 	}
@@ -93,12 +120,16 @@ public:
 				<< endl << "[-ofm flag to output feature map encoding (default: "
 				<< mOutputFeatureMap << ")]" << endl
 				<< "[-ok flag to output kernel matrix (default: " << mOutputKernel << ")]" << endl
+				<< "[-okf <text | dense | triangular> format of the -ok kernel matrix: text rows, or a binary file with the full matrix or its packed upper triangle (default: "
+				<< mKernelMatrixFormat << ")]" << endl
+				<< "[-okm flag to write binary -ok kernel matrices through a memory mapping of the output file rather than building them in memory (default: "
+				<< mKernelMatrixMemoryMap << ")]" << endl
 				<< "[-oaknn flag to output approximate k-nearest neighburs (default: "
 				<< mOutputApproximateKNN << ")]" << endl
 				<< "[-otknn flag to output true (i.e. implies full kernel matrix evaluation) k-nearest neighburs (default: "
 				<< mOutputTrueKNN << ")]" << endl << "[-oc flag to output clusters (default: "
 				<< mOutputCluster << ")]" << endl
-				<< "[-oac flag to output approximate clusters (default: "
+				<< "[-oac flag to output approximate clusters computed from the min-hash signatures alone, without keeping the feature vectors in memory (default: "
 				<< mOutputApproximateCluster << ")]" << endl << "[-nc num centers (default: "
 				<< mNumCenters << ")]" << endl
 				<< "[-fcs fraction of dataset size to scan for centers (default: "
@@ -136,6 +167,8 @@ public:
 				<< mNonRedundantFilter << ") (the smaller the less similar the centers)]" << endl
 				<< "[-no-cache flag to deactivate caching of kernel value computation (to minimize memory usage) (default: "
 				<< !mCaching << ")]" << endl
+				<< "[-kcm <memory budget in MB> for the cache of kernel values; values not recently used are evicted when it is full (default: "
+				<< mKernelCacheMemory << ")]" << endl
 				<< "[-no-true-sort flag to deactivate sorting approximate neighbours with true kernel computation (default: "
 				<< !mTrueSort << ")]" << endl << "[-st <size threshold> (default: "
 				<< mSizeThreshold << ")]" << endl << "[-it <imbalance tolerance> (default: "
@@ -146,6 +179,40 @@ public:
 				<< "[-fde perform full density estimation (default: " << mFullDensityEstimation
 				<< ")]" << endl << "[-mri <num max refinement iterations> (default: "
 				<< mMaxRefinement << ")]" << endl
+				<< "[-nrc <num refinement chains> run independent refinement chains in parallel that share the refinement iterations and keep the best center set (default: "
+				<< mNumRefinementChains << ")]" << endl
+				<< "[-nbd <num bands> for banded Locality Sensitive Hashing, each band collates -nrb min-hash values into a single bin key (default: "
+				<< mNumBands << ") (0 to use one bin per hash function)]" << endl
+				<< "[-nrb <num rows per band> for banded Locality Sensitive Hashing (default: "
+				<< mNumRowsPerBand << ") (0 to derive it from -nhf and -nbd)]" << endl
+				<< "[-bth <target similarity threshold> to choose bands and rows per band within the budget of -nhf hash functions (default: "
+				<< mBandThreshold << ") (0 to deactivate)]" << endl
+				<< "[-wmh flag to use weighted min-hash (consistent weighted sampling) signatures that take feature values into account (default: "
+				<< mWeightedMinHash << ")]" << endl
+				<< "[-mset flag to stop admitting new candidates in exact neighbourhood search once max-score bounds show they cannot enter the top k (default: "
+				<< mMaxScoreEarlyTermination << ")]" << endl
+				<< "[-kbp flag to skip, in the exact k-nearest neighbour searches of -otknn, -otknnp and -oacc, the instances whose norm and block-max upper bounds show they cannot enter the top k; the norm bound needs unnormalized data (-nn), as normalized instances all have norm 1, and on such data the flag is usually slower than the default search (default: "
+				<< mBoundPruning << ")]" << endl
+				<< "[-idx <file name> for the bin data structure: load it if the file exists, otherwise compute it and save it there (default: "
+				<< mIndexFileName << ")]" << endl
+				<< "[-knng <file name> for the approximate k-nearest neighbour graph used in place of per instance approximate neighbourhood queries: load it if the file exists, otherwise build it by neighbour descent and save it there (default: "
+				<< mKNNGraphFileName << ")]" << endl
+				<< "[-nndi <num max iterations> of neighbour descent when building the -knng graph (default: "
+				<< mNNDescentMaxIterations << ")]" << endl
+				<< "[-cds <num bits> keep the dataset compressed in memory, with delta encoded feature ids and values quantised to 8 or 16 bits (default: "
+				<< mCompressedValueBits << ") (0 to keep the uncompressed vectors)]" << endl
+				<< "[-hp flag to back the memory of the dataset with transparent huge pages (default: "
+				<< mHugePages << ")]" << endl
+				<< "[-apt <threshold> to output all the pairs of instances with kernel value not smaller than the threshold, found exactly with prefix filtering, as a binary similarity graph (default: "
+				<< mAllPairsThreshold << ") (0 to deactivate)]" << endl
+				<< "[-des <num dimensions> of a dense count-sketch embedding of the instances used in place of the kernel to rank the approximate neighbours (default: "
+				<< mDenseEmbeddingSize << ") (0 to use the kernel)]" << endl
+				<< "[-desr <shortlist factor> re-rank under the exact kernel the shortlist of the factor times knn best neighbours under the -des embedding (default: "
+				<< mDenseEmbeddingRerankFactor << ") (0 to deactivate)]" << endl
+				<< "[-serve flag to answer approximate k-nearest neighbour queries (one sparse ascii vector per line, batches separated by an empty line) read from stdin (default: "
+				<< mServe << ")]" << endl
+				<< "[-socket <file name> of a local unix socket on which -serve accepts connections instead of stdin (default: "
+				<< mSocketFileName << ")]" << endl
 				<< "[-debug <debug level> for NSPDK data structures (default: " << mDebug << ")]"
 				<< endl;
 		exit(0);
@@ -180,6 +247,8 @@ public:
 			else if ((*it) == "-oacc") mOutputAccuracy = true;
 			else if ((*it) == "-ofm") mOutputFeatureMap = true;
 			else if ((*it) == "-ok") mOutputKernel = true;
+			else if ((*it) == "-okf") mKernelMatrixFormat = (*(++it));
+			else if ((*it) == "-okm") mKernelMatrixMemoryMap = true;
 			else if ((*it) == "-oaknn") mOutputApproximateKNN = true;
 			else if ((*it) == "-otknn") mOutputTrueKNN = true;
 			else if ((*it) == "-oaknnp") mOutputApproximateKNNPrediction = true;
@@ -205,7 +274,25 @@ public:
 			else if ((*it) == "-usn") mSharedNeighbourhood = true;
 			else if ((*it) == "-fde") mFullDensityEstimation = true;
 			else if ((*it) == "-mr") mMaxRefinement = stream_cast<unsigned>(*(++it));
+			else if ((*it) == "-nrc") mNumRefinementChains = stream_cast<unsigned>(*(++it));
 			else if ((*it) == "-threads") mThreads = stream_cast<unsigned>(*(++it));
+			else if ((*it) == "-nbd") mNumBands = stream_cast<unsigned>(*(++it));
+			else if ((*it) == "-nrb") mNumRowsPerBand = stream_cast<unsigned>(*(++it));
+			else if ((*it) == "-bth") mBandThreshold = stream_cast<double>(*(++it));
+			else if ((*it) == "-idx") mIndexFileName = (*(++it));
+			else if ((*it) == "-knng") mKNNGraphFileName = (*(++it));
+			else if ((*it) == "-nndi") mNNDescentMaxIterations = stream_cast<unsigned>(*(++it));
+			else if ((*it) == "-cds") mCompressedValueBits = stream_cast<unsigned>(*(++it));
+			else if ((*it) == "-hp") mHugePages = true;
+			else if ((*it) == "-apt") mAllPairsThreshold = stream_cast<double>(*(++it));
+			else if ((*it) == "-des") mDenseEmbeddingSize = stream_cast<unsigned>(*(++it));
+			else if ((*it) == "-desr") mDenseEmbeddingRerankFactor = stream_cast<unsigned>(*(++it));
+			else if ((*it) == "-serve") mServe = true;
+			else if ((*it) == "-socket") mSocketFileName = (*(++it));
+			else if ((*it) == "-wmh") mWeightedMinHash = true;
+			else if ((*it) == "-mset") mMaxScoreEarlyTermination = true;
+			else if ((*it) == "-kbp") mBoundPruning = true;
+			else if ((*it) == "-kcm") mKernelCacheMemory = stream_cast<double>(*(++it));
 
 			else {
 				cerr << "Unrecognized parameter: " << (*it) << "." << endl;
@@ -217,6 +304,46 @@ public:
 			cerr << "Wrong value for parameter: -t: " << mMatchingType << endl;
 			throw exception();
 		}
+		if (!(mKernelMatrixFormat == "text" || mKernelMatrixFormat == "dense" || mKernelMatrixFormat == "triangular")) {
+			cerr << "Wrong value for parameter: -okf: " << mKernelMatrixFormat << endl;
+			throw exception();
+		}
+		if (mAllPairsThreshold < 0) {
+			cerr << "Wrong value for parameter: -apt: " << mAllPairsThreshold << " (expected >= 0, 0 to deactivate)" << endl;
+			throw exception();
+		}
+		if (mBandThreshold < 0 || mBandThreshold >= 1) {
+			cerr << "Wrong value for parameter: -bth: " << mBandThreshold << " (expected in [0,1))" << endl;
+			throw exception();
+		}
+		SetBandParameters();
+	}
+
+	///Resolves the number of bands and rows per band for banded LSH: with b bands of r rows two instances
+	///with jaccard similarity s become candidates with probability 1-(1-s^r)^b, i.e. the S-curve has its
+	///steepest point around the threshold (1/b)^(1/r)
+	void SetBandParameters() {
+		if (mBandThreshold > 0 && mNumBands == 0 && mNumRowsPerBand == 0) {
+			//search among all the (b,r) pairs that fit in the budget of hash functions the one with threshold closest to the target
+			double best_error = numeric_limits<double>::max();
+			for (unsigned r = 1; r <= mNumHashFunctions; ++r) {
+				unsigned b = mNumHashFunctions / r;
+				double error = fabs(BandThreshold(b, r) - mBandThreshold);
+				if (error < best_error) {
+					best_error = error;
+					mNumBands = b;
+					mNumRowsPerBand = r;
+				}
+			}
+		} else if (mNumBands > 0 && mNumRowsPerBand == 0) {
+			mNumRowsPerBand = max(1u, mNumHashFunctions / mNumBands);
+		} else if (mNumBands == 0 && mNumRowsPerBand > 0) {
+			mNumBands = max(1u, mNumHashFunctions / mNumRowsPerBand);
+		}
+	}
+
+	static double BandThreshold(unsigned aNumBands, unsigned aNumRowsPerBand) {
+		return pow(1.0 / aNumBands, 1.0 / aNumRowsPerBand);
 	}
 
 public:
@@ -242,6 +369,8 @@ public:
 	bool mOutputAccuracy;
 	bool mOutputFeatureMap;
 	bool mOutputKernel;
+	string mKernelMatrixFormat;
+	bool mKernelMatrixMemoryMap;
 	bool mOutputApproximateKNN;
 	bool mOutputTrueKNN;
 	bool mOutputCluster;
@@ -267,41 +396,972 @@ public:
 	bool mSharedNeighbourhood;
 	bool mFullDensityEstimation;
 	unsigned mMaxRefinement;
+	unsigned mNumRefinementChains;
+	unsigned mNumBands;
+	unsigned mNumRowsPerBand;
+	double mBandThreshold;
+	string mIndexFileName;
+	string mKNNGraphFileName;
+	unsigned mNNDescentMaxIterations;
+	unsigned mCompressedValueBits;
+	bool mHugePages;
+	double mAllPairsThreshold;
+	unsigned mDenseEmbeddingSize;
+	unsigned mDenseEmbeddingRerankFactor;
+	bool mServe;
+	string mSocketFileName;
+	bool mWeightedMinHash;
+	bool mMaxScoreEarlyTermination;
+	bool mBoundPruning;
+	double mKernelCacheMemory;
 	int mDebug;
 	unsigned mThreads;
 } PARAM_OBJ;
 
 
-typedef std::tr1::unordered_map<unsigned, int> umap_uint_int;
 typedef std::tr1::unordered_map<unsigned, vector<unsigned> > umap_uint_vec_uint;
 
+const unsigned BIN_DATA_STRUCTURE_FORMAT_VERSION = 2;
+const unsigned KNN_GRAPH_FORMAT_VERSION = 2;
+const unsigned GRAM_MATRIX_FORMAT_VERSION = 1;
+const unsigned ALL_PAIRS_FORMAT_VERSION = 1;
+const unsigned GRAM_MATRIX_TILE_SIZE = 64; //rows (and columns) of the tiles in which the kernel matrix is computed
+const unsigned BOUND_BLOCK_SIZE = 64; //consecutive instances that share a block-max bound in pruned top-k searches
+const size_t ARENA_CHUNK_SIZE = 64 << 20; //bytes mapped at a time by the arena of the dataset matrix
+const double NN_DESCENT_MIN_UPDATE_RATE = 0.001; //neighbour descent stops when fewer than this fraction of neighbor entries change
+
 bool mySort (pair<double, unsigned> i, pair<double, unsigned> j) { return (i.first < j.first); }
 bool mySortSecond (pair<unsigned, int> i, pair<unsigned, int> j) { return (i.second < j.second); }
 
+///Dense accumulator of per instance values (e.g. bin collision counts or partial kernel values) for one
+///query. A value is valid only if the stamp of the instance equals the current epoch, so that starting a new
+///query costs O(1) and only the touched instances have to be visited. Buffers keep their capacity across queries.
+template<class ValueType>
+class DenseAccumulatorClass {
+public:
+	DenseAccumulatorClass()
+			: mEpoch(0) {
+	}
+
+	void Begin(unsigned aDataSize) {
+		if (mStamp.size() < aDataSize) {
+			mStamp.resize(aDataSize, 0);
+			mValue.resize(aDataSize, 0);
+		}
+		mTouched.clear();
+		mEpoch++;
+		if (mEpoch == 0) { //on wrap around invalidate all stamps
+			fill(mStamp.begin(), mStamp.end(), 0);
+			mEpoch = 1;
+		}
+	}
+
+	inline void Add(unsigned aID, ValueType aValue) {
+		if (mStamp[aID] != mEpoch) {
+			mStamp[aID] = mEpoch;
+			mValue[aID] = 0;
+			mTouched.push_back(aID);
+		}
+		mValue[aID] += aValue;
+	}
+
+	inline void Increment(unsigned aID) {
+		Add(aID, 1);
+	}
+
+	inline bool IsTouched(unsigned aID) const {
+		return mStamp[aID] == mEpoch;
+	}
+
+	inline ValueType Count(unsigned aID) const {
+		return mValue[aID];
+	}
+
+	inline const vector<unsigned>& Touched() const {
+		return mTouched;
+	}
+
+public:
+	vector<pair<ValueType, unsigned> > mRankList; //scratch buffer to rank the touched instances
+private:
+	unsigned mEpoch;
+	vector<unsigned> mStamp;
+	vector<ValueType> mValue;
+	vector<unsigned> mTouched;
+};
+
+typedef DenseAccumulatorClass<int> CollisionCounterClass;
+typedef DenseAccumulatorClass<double> ScoreAccumulatorClass;
+
+///Bounded, thread safe cache of pairwise values (e.g. kernel values) keyed by the packed pair of instance ids. Slots are partitioned
+///in shards, each protected by its own lock. A key can only live in one of the WAYS slots of its bucket; when
+///they are all taken the slot to replace is chosen with the CLOCK policy, i.e. slots that have been hit since
+///the last sweep of the bucket hand get a second chance.
+class KernelCacheClass {
+public:
+	KernelCacheClass()
+			: mMaxNumBucketsPerShard(0) {
+		for (unsigned s = 0; s < NUM_SHARDS; ++s) {
+			omp_init_lock(&mShardList[s].mLock);
+			mShardList[s].mNumBuckets = mShardList[s].mNumEntries = 0;
+		}
+	}
+
+	~KernelCacheClass() {
+		for (unsigned s = 0; s < NUM_SHARDS; ++s)
+			omp_destroy_lock(&mShardList[s].mLock);
+	}
+
+	///Sets the cache up for (at most) aMaxNumEntries values using at most aMemoryBudget bytes. Shards start small
+	///and double when they fill up, so that memory follows the pairs actually computed; the budget is only a cap
+	///and values are evicted once a shard has reached it.
+	void Init(double aMaxNumEntries, double aMemoryBudget) {
+		double num_slots = min(aMaxNumEntries, aMemoryBudget / SLOT_BYTES);
+		mMaxNumBucketsPerShard = max(1.0, ceil(num_slots / (NUM_SHARDS * WAYS)));
+		for (unsigned s = 0; s < NUM_SHARDS; ++s) {
+			Shard& shard = mShardList[s];
+			Resize(shard, min((unsigned) INITIAL_NUM_BUCKETS, mMaxNumBucketsPerShard));
+			shard.mNumEntries = 0;
+			shard.mNumHits = shard.mNumMisses = shard.mNumEvictions = 0;
+		}
+	}
+
+	bool Get(unsigned aI, unsigned aJ, double& oValue) {
+		unsigned long long key = Key(aI, aJ);
+		Shard& shard = GetShard(key);
+		bool is_found = false;
+		omp_set_lock(&shard.mLock);
+		unsigned first = FirstSlot(shard, key);
+		for (unsigned w = first; w < first + WAYS; ++w)
+			if (shard.mSlotList[w].mKey == key) {
+				oValue = shard.mSlotList[w].mValue;
+				shard.mReferencedList[w] = 1;
+				is_found = true;
+				break;
+			}
+		if (is_found) shard.mNumHits++;
+		else shard.mNumMisses++;
+		omp_unset_lock(&shard.mLock);
+		return is_found;
+	}
+
+	void Put(unsigned aI, unsigned aJ, double aValue) {
+		unsigned long long key = Key(aI, aJ);
+		Shard& shard = GetShard(key);
+		omp_set_lock(&shard.mLock);
+		if (shard.mNumEntries >= shard.mNumBuckets * WAYS * 3 / 4 && shard.mNumBuckets < mMaxNumBucketsPerShard)
+			Resize(shard, min(2 * shard.mNumBuckets, mMaxNumBucketsPerShard));
+		unsigned first, target;
+		for (;;) { //a full bucket makes the shard grow; only at full size are values evicted
+			first = FirstSlot(shard, key);
+			target = first + WAYS;
+			for (unsigned w = first; w < first + WAYS; ++w)
+				if (shard.mSlotList[w].mKey == key || shard.mSlotList[w].mKey == EMPTY_KEY) {
+					target = w;
+					break;
+				}
+			if (target < first + WAYS || shard.mNumBuckets == mMaxNumBucketsPerShard) break;
+			Resize(shard, min(2 * shard.mNumBuckets, mMaxNumBucketsPerShard));
+		}
+		if (target == first + WAYS) { //all slots taken: advance the clock hand up to the first unreferenced slot
+			unsigned char& hand = shard.mHandList[first / WAYS];
+			while (shard.mReferencedList[first + hand]) {
+				shard.mReferencedList[first + hand] = 0;
+				hand = (hand + 1) % WAYS;
+			}
+			target = first + hand;
+			hand = (hand + 1) % WAYS;
+			shard.mNumEvictions++;
+		} else if (shard.mSlotList[target].mKey == EMPTY_KEY) shard.mNumEntries++;
+		shard.mSlotList[target].mKey = key;
+		shard.mSlotList[target].mValue = aValue;
+		shard.mReferencedList[target] = 0;
+		omp_unset_lock(&shard.mLock);
+	}
+
+	void OutputStatistics(ostream& out, const string& aName) const {
+		double num_hits = 0, num_misses = 0, num_evictions = 0, num_slots = 0;
+		for (unsigned s = 0; s < NUM_SHARDS; ++s) {
+			num_slots += (double) mShardList[s].mNumBuckets * WAYS;
+			num_hits += mShardList[s].mNumHits;
+			num_misses += mShardList[s].mNumMisses;
+			num_evictions += mShardList[s].mNumEvictions;
+		}
+		double num_lookups = num_hits + num_misses;
+		out << aName << " cache: " << num_slots << " slots (" << num_slots * SLOT_BYTES / 1048576 << " MB of "
+				<< (double) mMaxNumBucketsPerShard * NUM_SHARDS * WAYS * SLOT_BYTES / 1048576 << " MB) hits: "
+				<< num_hits << " misses: " << num_misses << " hit rate: "
+				<< (num_lookups > 0 ? num_hits / num_lookups : 0) << " evictions: " << num_evictions << endl;
+	}
+
+private:
+	struct Slot {
+		unsigned long long mKey;
+		double mValue;
+		Slot()
+				: mKey(EMPTY_KEY), mValue(0) {
+		}
+	};
+
+	struct Shard {
+		omp_lock_t mLock;
+		vector<Slot> mSlotList;
+		vector<unsigned char> mReferencedList;
+		vector<unsigned char> mHandList;
+		unsigned mNumBuckets;
+		unsigned mNumEntries;
+		unsigned long long mNumHits;
+		unsigned long long mNumMisses;
+		unsigned long long mNumEvictions;
+	};
+
+	static unsigned long long Key(unsigned aI, unsigned aJ) {
+		return ((unsigned long long) aI << 32) | aJ;
+	}
+
+	Shard& GetShard(unsigned long long aKey) {
+		return mShardList[HashMix(aKey >> 32, aKey & 0xFFFFFFFF, 0) % NUM_SHARDS];
+	}
+
+	unsigned FirstSlot(const Shard& aShard, unsigned long long aKey) const {
+		return (HashMix(aKey >> 32, aKey & 0xFFFFFFFF, 1) % aShard.mNumBuckets) * WAYS;
+	}
+
+	///Rehashes the values of a shard into aNumBuckets buckets; values that find no free way are dropped
+	void Resize(Shard& aShard, unsigned aNumBuckets) {
+		vector<Slot> slot_list(aNumBuckets * WAYS);
+		vector<unsigned char> referenced_list(aNumBuckets * WAYS, 0);
+		aShard.mNumBuckets = aNumBuckets;
+		aShard.mNumEntries = 0;
+		for (unsigned i = 0; i < aShard.mSlotList.size(); ++i) {
+			unsigned long long key = aShard.mSlotList[i].mKey;
+			if (key == EMPTY_KEY) continue;
+			unsigned first = FirstSlot(aShard, key);
+			for (unsigned w = first; w < first + WAYS; ++w)
+				if (slot_list[w].mKey == EMPTY_KEY) {
+					slot_list[w] = aShard.mSlotList[i];
+					referenced_list[w] = aShard.mReferencedList[i];
+					aShard.mNumEntries++;
+					break;
+				}
+		}
+		aShard.mSlotList.swap(slot_list);
+		aShard.mReferencedList.swap(referenced_list);
+		aShard.mHandList.assign(aNumBuckets, 0);
+	}
+
+	static const unsigned NUM_SHARDS = 64;
+	static const unsigned WAYS = 8;
+	static const unsigned INITIAL_NUM_BUCKETS = 16;
+	static const unsigned SLOT_BYTES = sizeof(Slot) + 1;
+	static const unsigned long long EMPTY_KEY = ~0ULL; //NOTE: the pair (2^32-1,2^32-1) cannot be cached
+
+	unsigned mMaxNumBucketsPerShard;
+	Shard mShardList[NUM_SHARDS];
+};
+
+///Statistics of a feature (column) over the rows of a sparse matrix
+struct FeatureStatisticsClass {
+	unsigned mCount; //number of rows with a non zero value for the feature
+	double mSum;
+	double mMaxValue;
+	FeatureStatisticsClass()
+			: 	mCount(0),
+				mSum(0),
+				mMaxValue(-numeric_limits<double>::max()) {
+	}
+};
+
+typedef std::tr1::unordered_map<unsigned, FeatureStatisticsClass> umap_uint_feature_statistics;
+
+///Memory arena that hands out slices of large chunks mapped from the system, optionally backed by transparent
+///huge pages. Slices are never freed one by one: all chunks are released at once when the arena is cleared.
+class ArenaClass {
+public:
+	ArenaClass()
+			: 	mUseHugePages(false),
+				mCurrent(0),
+				mCurrentEnd(0),
+				mUsed(0),
+				mReserved(0) {
+	}
+
+	~ArenaClass() {
+		Clear();
+	}
+
+	void SetHugePages(bool aUseHugePages) {
+		mUseHugePages = aUseHugePages;
+	}
+
+	///Returns a slice of aBytes bytes aligned to 16 bytes
+	void* Allocate(size_t aBytes) {
+		aBytes = (aBytes + 15) & ~(size_t) 15;
+		if (mCurrent == 0 || (size_t) (mCurrentEnd - mCurrent) < aBytes) {
+			size_t chunk_size = max(ARENA_CHUNK_SIZE, aBytes);
+			void* chunk = mmap(0, chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (chunk == MAP_FAILED) throw range_error("ERROR:Cannot allocate memory for the dataset");
+#ifdef MADV_HUGEPAGE
+			if (mUseHugePages) madvise(chunk, chunk_size, MADV_HUGEPAGE);
+#endif
+			mChunkList.push_back(make_pair((char*) chunk, chunk_size));
+			mCurrent = (char*) chunk;
+			mCurrentEnd = mCurrent + chunk_size;
+			mReserved += chunk_size;
+		}
+		void* slice = mCurrent;
+		mCurrent += aBytes;
+		mUsed += aBytes;
+		return slice;
+	}
+
+	void Clear() {
+		for (unsigned i = 0; i < mChunkList.size(); ++i)
+			munmap(mChunkList[i].first, mChunkList[i].second);
+		mChunkList.clear();
+		mCurrent = mCurrentEnd = 0;
+		mUsed = mReserved = 0;
+	}
+
+	double Used() const {
+		return mUsed;
+	}
+
+	double Reserved() const {
+		return mReserved;
+	}
+
+private:
+	ArenaClass(const ArenaClass&);
+	ArenaClass& operator=(const ArenaClass&);
+
+	bool mUseHugePages;
+	vector<pair<char*, size_t> > mChunkList;
+	char* mCurrent;
+	char* mCurrentEnd;
+	size_t mUsed;
+	size_t mReserved;
+};
+
+///Sparse matrix in compressed sparse row format. The (feature id, value) pairs of the rows are stored one row
+///after the other in the chunks of an arena, each row followed by a terminator pair as in SVector, and the
+///row list points to the first pair of each row. Rows are handed out as views, so that kernel evaluations
+///walk contiguous memory without touching any reference count. Loading does not reallocate nor copy rows
+///already stored, and the whole matrix is freed releasing a few chunks.
+class SparseMatrixClass {
+public:
+	SparseMatrixClass()
+			: mNumPairs(0) {
+	}
+
+	void SetHugePages(bool aUseHugePages) {
+		mArena.SetHugePages(aUseHugePages);
+	}
+
+	void AddRow(const SVector& aX) {
+		int npairs = aX.npairs();
+		SVector::Pair* row = (SVector::Pair*) mArena.Allocate(sizeof(SVector::Pair) * (npairs + 1));
+		if (npairs > 0) memcpy(row, (const SVector::Pair*) aX, sizeof(SVector::Pair) * npairs);
+		row[npairs].i = -1;
+		row[npairs].v = 0;
+		mRowList.push_back(SVectorView(row, npairs));
+		mNumPairs += npairs;
+	}
+
+	void Trim() {
+		vector<SVectorView>(mRowList).swap(mRowList);
+	}
+
+	void Clear() {
+		mRowList.clear();
+		mArena.Clear();
+		mNumPairs = 0;
+	}
+
+	unsigned NumRows() const {
+		return mRowList.size();
+	}
+
+	inline SVectorView Row(unsigned aID) const {
+		return mRowList[aID];
+	}
+
+	SVector RowVector(unsigned aID) const {
+		SVector x;
+		for (const SVector::Pair* p = Row(aID); p->i >= 0; p++)
+			x.set(p->i, p->v);
+		return x;
+	}
+
+	///Dot products between aX and the rows in [aBegin,aEnd)
+	void Dot(const SVectorView& aX, unsigned aBegin, unsigned aEnd, vector<double>& oValueList) const {
+		oValueList.resize(aEnd - aBegin);
+		for (unsigned i = aBegin; i < aEnd; ++i)
+			oValueList[i - aBegin] = dot(aX, Row(i));
+	}
+
+	///Dot products between each query and the rows in [aBegin,aEnd), stored query by query in oValueList; rows
+	///are visited in blocks so that a block stays in cache while all the queries are paired with it
+	void Dot(const vector<SVectorView>& aQueryList, unsigned aBegin, unsigned aEnd, vector<double>& oValueList) const {
+		const unsigned BLOCK_SIZE = 64;
+		unsigned num_rows = aEnd - aBegin;
+		oValueList.resize(aQueryList.size() * num_rows);
+		for (unsigned block_begin = aBegin; block_begin < aEnd; block_begin += BLOCK_SIZE) {
+			unsigned block_end = min(aEnd, block_begin + BLOCK_SIZE);
+			for (unsigned q = 0; q < aQueryList.size(); ++q)
+				for (unsigned i = block_begin; i < block_end; ++i)
+					oValueList[q * num_rows + i - aBegin] = dot(aQueryList[q], Row(i));
+		}
+	}
+
+	///Euclidean norm of each row
+	void RowNorms(vector<double>& oNormList) const {
+		oNormList.resize(NumRows());
+		for (unsigned i = 0; i < NumRows(); ++i)
+			oNormList[i] = sqrt(dot(Row(i), Row(i)));
+	}
+
+	void ColumnStatistics(umap_uint_feature_statistics& oStatistics) const {
+		oStatistics.clear();
+		for (unsigned i = 0; i < NumRows(); ++i)
+			for (const SVector::Pair* p = Row(i); p->i >= 0; p++) {
+				FeatureStatisticsClass& statistics = oStatistics[p->i];
+				statistics.mCount++;
+				statistics.mSum += p->v;
+				statistics.mMaxValue = max(statistics.mMaxValue, (double) p->v);
+			}
+	}
+
+	///Memory used by the matrix, i.e. by the pairs in its arena and by its row list
+	double Memory() const {
+		return mArena.Used() + mRowList.capacity() * sizeof(SVectorView);
+	}
+
+	///Memory the rows would take as separate SVector objects, each with its own representation and pair array
+	double SVectorMemory() const {
+		return (mNumPairs + NumRows()) * sizeof(SVector::Pair)
+				+ NumRows() * (sizeof(SVector) + 4 * sizeof(int) + sizeof(void*));
+	}
+
+	void OutputStatistics(ostream& out) const {
+		umap_uint_feature_statistics statistics;
+		ColumnStatistics(statistics);
+		out << "Dataset matrix: " << NumRows() << " rows " << statistics.size() << " features " << mNumPairs
+				<< " values; memory: " << Memory() / 1048576 << " MB (" << mArena.Reserved() / 1048576
+				<< " MB mapped) vs " << SVectorMemory() / 1048576 << " MB as separate vectors" << endl;
+	}
+
+private:
+	ArenaClass mArena;
+	vector<SVectorView> mRowList;
+	double mNumPairs;
+};
+
+///Low dimensional dense sketch of the instances (count-sketch): each feature is hashed to one of the
+///dimensions with a random sign, so that the dot product of two embeddings is an unbiased estimate of the
+///sparse one. Embeddings are stored contiguously, one row of floats per instance.
+class DenseEmbeddingClass {
+public:
+	DenseEmbeddingClass()
+			: 	mSize(0),
+				mSeed(0) {
+	}
+
+	///NOTE: the size is rounded up to a multiple of 4 so that all rows stay 16 byte aligned for the SIMD dot
+	void Init(unsigned aNumInstances, unsigned aSize, unsigned aSeed) {
+		mSize = (aSize + 3) / 4 * 4;
+		mSeed = aSeed;
+		mValueList.assign((size_t) aNumInstances * mSize, 0);
+	}
+
+	bool IsActive() const {
+		return mSize > 0;
+	}
+
+	unsigned Size() const {
+		return mSize;
+	}
+
+	void Project(const SVectorView& aX, VFloat* oEmbedding) const {
+		fill(oEmbedding, oEmbedding + mSize, 0);
+		for (const SVector::Pair* p = aX; p && p->i >= 0; p++) {
+			unsigned long long hash = HashMix(p->i, mSeed, 0);
+			oEmbedding[(unsigned) hash % mSize] += (hash >> 63) ? -p->v : p->v;
+		}
+	}
+
+	void Set(unsigned aID, const SVectorView& aX) {
+		Project(aX, &mValueList[(size_t) aID * mSize]);
+	}
+
+	inline const VFloat* Row(unsigned aID) const {
+		return &mValueList[(size_t) aID * mSize];
+	}
+
+	inline double Dot(unsigned aI, unsigned aJ) const {
+		return dot(Row(aI), Row(aJ), mSize);
+	}
+
+	void OutputStatistics(ostream& out) const {
+		out << "Dense embedding: " << mValueList.size() / max(1u, mSize) << " instances " << mSize
+				<< " dimensions; memory: " << mValueList.size() * sizeof(VFloat) / 1048576.0 << " MB" << endl;
+	}
+
+private:
+	unsigned mSize;
+	unsigned mSeed;
+	vector<VFloat> mValueList;
+};
+
+///Compact in memory store of sparse vectors. The feature ids of each instance are delta encoded as variable
+///length integers (7 bits per byte) and each value is quantised to 8 or 16 bits relative to the largest absolute
+///value of the instance. Kernel values are computed decoding the instances on the fly in per thread buffers.
+class CompressedDatasetClass {
+public:
+	///Sequential reader of the (feature id, value) pairs of one instance in increasing feature id order
+	class Decoder {
+	public:
+		Decoder(const CompressedDatasetClass& aStore, unsigned aID)
+				: 	mIndex(-1),
+					mValue(0),
+					mPtr(aStore.Begin(aID)),
+					mEnd(aStore.Begin(aID + 1)),
+					mScale(aStore.mScaleList[aID]),
+					mIsWide(aStore.mValueBits == 16) {
+		}
+
+		inline bool Next() {
+			if (mPtr == mEnd) return false;
+			unsigned delta = 0;
+			unsigned shift = 0;
+			while (*mPtr & 128) {
+				delta |= (unsigned) (*mPtr++ & 127) << shift;
+				shift += 7;
+			}
+			delta |= (unsigned) (*mPtr++) << shift;
+			mIndex += delta + 1;
+			int level;
+			if (mIsWide) {
+				level = (short) (mPtr[0] | (mPtr[1] << 8));
+				mPtr += 2;
+			} else level = (signed char) *mPtr++;
+			mValue = level * mScale;
+			return true;
+		}
+
+	public:
+		int mIndex;
+		double mValue;
+	private:
+		const unsigned char* mPtr;
+		const unsigned char* mEnd;
+		double mScale;
+		bool mIsWide;
+	};
+
+	CompressedDatasetClass()
+			: 	mValueBits(0),
+				mNumPairs(0) {
+		mOffsetList.push_back(0);
+	}
+
+	void Init(unsigned aValueBits) {
+		if (aValueBits != 8 && aValueBits != 16)
+			throw range_error("ERROR:Values of the compressed dataset can only be quantised to 8 or 16 bits");
+		mValueBits = aValueBits;
+		mBufferList.resize(omp_get_max_threads(), vector<vector<SVector::Pair> >(2));
+		mBufferIDList.resize(omp_get_max_threads(), vector<int>(2, -1));
+		mBufferSizeList.resize(omp_get_max_threads(), vector<unsigned>(2, 0));
+	}
+
+	///Releases the memory reserved in excess while instances were added
+	void Trim() {
+		vector<unsigned char>(mByteList).swap(mByteList);
+		vector<unsigned long long>(mOffsetList).swap(mOffsetList);
+		vector<double>(mScaleList).swap(mScaleList);
+	}
+
+	bool IsActive() const {
+		return mValueBits > 0;
+	}
+
+	void Add(const SVector& aX) {
+		double scale = 0;
+		for (const SVector::Pair* p = aX; p && p->i >= 0; p++)
+			scale = max(scale, fabs((double) p->v));
+		const double max_level = mValueBits == 16 ? 32767 : 127;
+		int previous = -1;
+		for (const SVector::Pair* p = aX; p && p->i >= 0; p++) {
+			unsigned delta = p->i - previous - 1;
+			previous = p->i;
+			while (delta >= 128) {
+				mByteList.push_back((delta & 127) | 128);
+				delta >>= 7;
+			}
+			mByteList.push_back(delta);
+			int level = scale > 0 ? (int) floor(p->v / scale * max_level + .5) : 0;
+			mByteList.push_back(level & 255);
+			if (mValueBits == 16) mByteList.push_back((level >> 8) & 255);
+			mNumPairs++;
+		}
+		mScaleList.push_back(scale / max_level);
+		mOffsetList.push_back(mByteList.size());
+	}
+
+	///NOTE: the last two instances decoded by each thread are kept, so that scanning the dataset against a fixed
+	///instance decodes only one instance per kernel value
+	double Dot(unsigned aI, unsigned aJ) {
+		unsigned thread_id = omp_get_thread_num();
+		vector<vector<SVector::Pair> >& buffer = mBufferList[thread_id];
+		vector<int>& buffer_id = mBufferIDList[thread_id];
+		vector<unsigned>& buffer_size = mBufferSizeList[thread_id];
+		if (buffer_id[1] == (int) aI || buffer_id[0] == (int) aJ) {
+			swap(buffer[0], buffer[1]);
+			swap(buffer_id[0], buffer_id[1]);
+			swap(buffer_size[0], buffer_size[1]);
+		}
+		if (buffer_id[0] != (int) aI) {
+			buffer_size[0] = Decode(aI, buffer[0]);
+			buffer_id[0] = aI;
+		}
+		if (buffer_id[1] != (int) aJ) {
+			buffer_size[1] = Decode(aJ, buffer[1]);
+			buffer_id[1] = aJ;
+		}
+		return dot(&buffer[0][0], mBufferSizeList[thread_id][0], &buffer[1][0], mBufferSizeList[thread_id][1]);
+	}
+
+	double Dot(const SVectorView& aX, unsigned aID) const {
+		Decoder d(*this, aID);
+		const SVector::Pair* p = aX;
+		double sum = 0;
+		if (!p || p->i < 0 || !d.Next()) return 0;
+		while (true) {
+			if (p->i < d.mIndex) {
+				if ((++p)->i < 0) break;
+			} else if (p->i > d.mIndex) {
+				if (!d.Next()) break;
+			} else {
+				sum += (double) p->v * d.mValue;
+				if ((++p)->i < 0 || !d.Next()) break;
+			}
+		}
+		return sum;
+	}
+
+	///Decodes an instance in an array of pairs terminated by an index of -1 and returns the number of pairs;
+	///the array is only grown, so that decoding in the same buffer does not allocate
+	unsigned Decode(unsigned aID, vector<SVector::Pair>& oPairList) const {
+		const unsigned char* ptr = Begin(aID);
+		const unsigned char* end = Begin(aID + 1);
+		unsigned max_size = (end - ptr) / (mValueBits / 8 + 1) + 1;
+		if (oPairList.size() < max_size) oPairList.resize(max_size);
+		SVector::Pair* out = oPairList.empty() ? 0 : &oPairList[0];
+		const double scale = mScaleList[aID];
+		int index = -1;
+		while (ptr < end) {
+			unsigned delta = *ptr++;
+			if (delta & 128) {
+				delta &= 127;
+				unsigned shift = 7;
+				while (*ptr & 128) {
+					delta |= (unsigned) (*ptr++ & 127) << shift;
+					shift += 7;
+				}
+				delta |= (unsigned) (*ptr++) << shift;
+			}
+			index += delta + 1;
+			int level;
+			if (mValueBits == 16) {
+				level = (short) (ptr[0] | (ptr[1] << 8));
+				ptr += 2;
+			} else level = (signed char) *ptr++;
+			out->i = index;
+			out->v = level * scale;
+			out++;
+		}
+		out->i = -1;
+		return out - &oPairList[0];
+	}
+
+	void Decode(unsigned aID, SVector& oX) const {
+		oX.clear();
+		Decoder d(*this, aID);
+		while (d.Next())
+			oX.set(d.mIndex, d.mValue);
+	}
+
+	void OutputStatistics(ostream& out) const {
+		double memory = mByteList.capacity() + mOffsetList.capacity() * sizeof(unsigned long long)
+				+ mScaleList.capacity() * sizeof(double);
+		double uncompressed_memory = mNumPairs * sizeof(SVector::Pair)
+				+ mScaleList.size() * (sizeof(SVector) + 4 * sizeof(int) + sizeof(void*));
+		out << "Compressed dataset: " << mScaleList.size() << " instances " << mNumPairs << " values quantised to "
+				<< mValueBits << " bits; memory: " << memory / 1048576 << " MB ("
+				<< (mNumPairs > 0 ? memory / mNumPairs : 0) << " bytes per value) vs "
+				<< uncompressed_memory / 1048576 << " MB uncompressed" << endl;
+	}
+
+private:
+	const unsigned char* Begin(unsigned aID) const {
+		return mByteList.empty() ? 0 : &mByteList[0] + mOffsetList[aID];
+	}
+
+	unsigned mValueBits;
+	double mNumPairs;
+	vector<unsigned char> mByteList;
+	vector<unsigned long long> mOffsetList; //instance id -> offset of its first byte (one extra entry for the end)
+	vector<double> mScaleList; //instance id -> value of one quantisation level
+	vector<vector<vector<SVector::Pair> > > mBufferList; //thread -> two decoding buffers
+	vector<vector<int> > mBufferIDList; //thread -> id of the instance in each buffer (-1 if none)
+	vector<vector<unsigned> > mBufferSizeList; //thread -> number of pairs in each buffer
+};
+
+///Kernel (Gram) matrix of a dataset, stored either in full or as the packed upper triangle, where row i holds
+///the values K(i,j) for j>=i. The storage is a buffer in memory or a shared memory mapping of the output file,
+///so that matrices larger than the memory can be written tile by tile. The binary format is the header size
+///and header followed by the values as doubles in row major order.
+class GramMatrixClass {
+public:
+	GramMatrixClass()
+			: 	mSize(0),
+				mIsTriangular(false),
+				mData(0),
+				mMapping(0),
+				mMappingSize(0),
+				mFd(-1) {
+	}
+
+	~GramMatrixClass() {
+		Close();
+	}
+
+	///Allocates the matrix in memory or, if aFileName is not empty, maps it onto that file (header included)
+	void Init(unsigned aSize, bool aIsTriangular, const string& aFileName = "") {
+		Close();
+		mSize = aSize;
+		mIsTriangular = aIsTriangular;
+		vector<unsigned> header = Header();
+		unsigned header_size = header.size();
+		size_t header_bytes = sizeof(unsigned) * (header_size + 1);
+		if (aFileName == "") {
+			mBuffer.assign(NumValues(), 0);
+			mData = mBuffer.empty() ? 0 : &mBuffer[0];
+			return;
+		}
+		mMappingSize = header_bytes + sizeof(double) * NumValues();
+		mFd = open(aFileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (mFd < 0) throw range_error("ERROR:Cannot open file:" + aFileName);
+		if (ftruncate(mFd, mMappingSize) != 0) throw range_error("ERROR:Cannot resize file:" + aFileName);
+		void* mapping = mmap(0, mMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+		if (mapping == MAP_FAILED) throw range_error("ERROR:Cannot memory map file:" + aFileName);
+		mMapping = (char*) mapping;
+		memcpy(mMapping, &header_size, sizeof(unsigned));
+		memcpy(mMapping + sizeof(unsigned), &header[0], sizeof(unsigned) * header_size);
+		mData = (double*) (mMapping + header_bytes);
+	}
+
+	///Sets K(i,j) for i<=j; the full matrix also receives the symmetric value
+	inline void Set(unsigned aI, unsigned aJ, double aValue) {
+		mData[Offset(aI, aJ)] = aValue;
+		if (!mIsTriangular) mData[Offset(aJ, aI)] = aValue;
+	}
+
+	inline double Get(unsigned aI, unsigned aJ) const {
+		if (mIsTriangular && aI > aJ) return mData[Offset(aJ, aI)];
+		return mData[Offset(aI, aJ)];
+	}
+
+	///Writes the in memory matrix in the binary format (mapped matrices are written by Close)
+	void Save(ostream& out) const {
+		vector<unsigned> header = Header();
+		unsigned header_size = header.size();
+		out.write((const char*) &header_size, sizeof(unsigned));
+		out.write((const char*) &header[0], sizeof(unsigned) * header_size);
+		if (!mBuffer.empty()) out.write((const char*) &mBuffer[0], sizeof(double) * mBuffer.size());
+		if (!out.good()) throw range_error("ERROR:Cannot write kernel matrix");
+	}
+
+	void Close() {
+		if (mMapping) {
+			munmap(mMapping, mMappingSize);
+			mMapping = 0;
+		}
+		if (mFd >= 0) {
+			close(mFd);
+			mFd = -1;
+		}
+		mData = mBuffer.empty() ? 0 : &mBuffer[0];
+	}
+
+	unsigned Size() const {
+		return mSize;
+	}
+
+private:
+	vector<unsigned> Header() const {
+		vector<unsigned> header;
+		header.push_back(GRAM_MATRIX_FORMAT_VERSION);
+		header.push_back(mSize);
+		header.push_back(mIsTriangular);
+		return header;
+	}
+
+	size_t NumValues() const {
+		if (mIsTriangular) return (size_t) mSize * (mSize + 1) / 2;
+		return (size_t) mSize * mSize;
+	}
+
+	inline size_t Offset(unsigned aI, unsigned aJ) const {
+		if (mIsTriangular) return (size_t) aI * mSize - (size_t) aI * (aI + 1) / 2 + aJ;
+		return (size_t) aI * mSize + aJ;
+	}
+
+	unsigned mSize;
+	bool mIsTriangular;
+	double* mData; //start of the values, either in mBuffer or in mMapping
+	vector<double> mBuffer;
+	char* mMapping;
+	size_t mMappingSize;
+	int mFd;
+};
+
+///Posting list of a feature in the inverted index of the dataset
+struct PostingListClass {
+	vector<unsigned> mIDList;
+	vector<VFloat> mValueList;
+	double mMaxValue;
+	PostingListClass()
+			: mMaxValue(0) {
+	}
+};
+
+typedef std::tr1::unordered_map<unsigned, PostingListClass> umap_uint_posting;
+
+///Entry of the neighbor list of an instance while the approximate kNN graph is refined
+struct GraphNeighborClass {
+	double mValue;
+	unsigned mID;
+	bool mIsNew; //true if the entry has not yet taken part in a local join
+};
+
+///Buffered stream over a file descriptor (e.g. a connected socket)
+class FdStreamBuf: public streambuf {
+public:
+	FdStreamBuf(int aFd)
+			: mFd(aFd) {
+		setg(mInBuffer, mInBuffer, mInBuffer);
+		setp(mOutBuffer, mOutBuffer + BUFFER_SIZE);
+	}
+
+	~FdStreamBuf() {
+		sync();
+	}
+
+protected:
+	int underflow() {
+		ssize_t n;
+		do {
+			n = read(mFd, mInBuffer, BUFFER_SIZE);
+		} while (n < 0 && errno == EINTR);
+		if (n <= 0) return traits_type::eof();
+		setg(mInBuffer, mInBuffer, mInBuffer + n);
+		return traits_type::to_int_type(*gptr());
+	}
+
+	int overflow(int aC) {
+		if (sync() != 0) return traits_type::eof();
+		if (aC != traits_type::eof()) {
+			*pptr() = (char) aC;
+			pbump(1);
+		}
+		return traits_type::not_eof(aC);
+	}
+
+	int sync() {
+		char* p = pbase();
+		while (p < pptr()) {
+			ssize_t n = write(mFd, p, pptr() - p);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return -1;
+			p += n;
+		}
+		setp(mOutBuffer, mOutBuffer + BUFFER_SIZE);
+		return 0;
+	}
+
+private:
+	static const int BUFFER_SIZE = 65536;
+	int mFd;
+	char mInBuffer[BUFFER_SIZE];
+	char mOutBuffer[BUFFER_SIZE];
+};
+
 
 class NSPDKClass {
 protected:
 	NSPDK_FeatureGenerator* pmFeatureGenerator;
 	NSPDK_FeatureGenerator* pmAbstractFeatureGenerator;
 
-	vector<SVector> mDataset;
+	vector<SVector> mDataset; //NOTE: the instances are kept in mDatasetMatrix (or in mCompressedDataset with -cds) and these are empty
+	SparseMatrixClass mDatasetMatrix;
+	DenseEmbeddingClass mDenseEmbedding;
+	CompressedDatasetClass mCompressedDataset;
+	vector<SVectorView> mDatasetViewList; //views of the rows of mDatasetMatrix, taken once the input is complete
 	vector<umap_uint_vec_uint> mBinDataStructure;
-	map<pair<unsigned, unsigned>, double> mKernelMap;
-	//multimap<unsigned, unsigned> mInvertedIndex;
+	KernelCacheClass mKernelCache;
+	umap_uint_posting mInvertedIndex; //feature id -> (instance id, value) list
+	bool mInvertedIndexIsNonNegative; //true if all values in the index are >=0, i.e. partial scores are lower bounds
+	vector<ScoreAccumulatorClass> mScoreAccumulatorList; //one per thread
 	umap_uint_vec_uint mSignatureMap;
+	vector<vector<unsigned> > mSketchList; //signatures kept from the input in sketch only mode (-oac), where instances are discarded
+	vector<vector<unsigned> > mKNNGraph; //id -> approximate neighborhood (the instance itself first, then by decreasing similarity)
+	vector<vector<float> > mKNNGraphValueList; //id -> similarity to each neighbor in mKNNGraph
 
 	double mAlpha;
 	vector<double> mApproximateDensityMap;
 	vector<double> mTrueDensityMap;
 	umap_uint_vec_uint mApproximateNeighborhoodMap;
+	umap_uint_vec_uint mSortedNeighborhoodMap; //id -> approximate neighborhood sorted by id, for shared neighborhood similarity
+	KernelCacheClass mSharedNeighborhoodCache;
 	vector<unsigned> mIdMap;
 	vector<bool> mFilteredHashFunctionList;
 	vector<int> mGreyList;
+	vector<CollisionCounterClass> mCollisionCounterList; //one per thread
+	HistogramClass mBinSizeHistogram;
+	vector<unsigned> mNumDroppedBinList;
+	vector<unsigned> mNumDroppedInstanceList;
+
+	//statistics on the candidate sets retrieved from the bin data structure
+	unsigned mNumCandidateQueries;
+	double mCandidateSizeSum;
+	unsigned mCandidateSizeMax;
+	double mTrimmedCandidateSizeSum;
+
+	//bounds and counters of the pruned exact top-k searches
+	vector<double> mNormList;
+	vector<double> mBlockNormList;
+	SparseMatrixClass mBlockMaxMatrix;
+	bool mBlockMaxIsValid;
+	double mNumBoundEvaluated;
+	double mNumBoundSkipped;
 public:
 	NSPDKClass(	NSPDK_FeatureGenerator* paFeatureGenerator,
 				NSPDK_FeatureGenerator* paAbstractFeatureGenerator)
 			: 	pmFeatureGenerator(paFeatureGenerator),
-				pmAbstractFeatureGenerator(paAbstractFeatureGenerator) {
+				pmAbstractFeatureGenerator(paAbstractFeatureGenerator),
+				mNumCandidateQueries(0),
+				mCandidateSizeSum(0),
+				mCandidateSizeMax(0),
+				mTrimmedCandidateSizeSum(0),
+				mBlockMaxIsValid(false),
+				mNumBoundEvaluated(0),
+				mNumBoundSkipped(0) {
+		mCollisionCounterList.resize(omp_get_max_threads());
+		mScoreAccumulatorList.resize(omp_get_max_threads());
+		mInvertedIndexIsNonNegative = true;
+		if (PARAM_OBJ.mCompressedValueBits > 0) mCompressedDataset.Init(PARAM_OBJ.mCompressedValueBits);
+		mDatasetMatrix.SetHugePages(PARAM_OBJ.mHugePages);
 	}
 
 	void Generate(const GraphClass& aG, SVector& oX) {
@@ -356,6 +1416,7 @@ public:
 	}
 
 	void Input() {
+		double load_start = omp_get_wtime();
 		if (PARAM_OBJ.mSparseBinaryInputFileName != "") InputSparse(
 				PARAM_OBJ.mSparseBinaryInputFileName, "binary");
 		else if (PARAM_OBJ.mSparseASCIIInputFileName != "") InputSparse(
@@ -369,6 +1430,75 @@ public:
 				Load(PARAM_OBJ.mGspanInputFileName, "memory");
 			}
 		} else throw range_error("ERROR:No input file name specified");
+		if (mCompressedDataset.IsActive()) {
+			mCompressedDataset.Trim();
+			mCompressedDataset.OutputStatistics(cout);
+		}
+		mDatasetMatrix.Trim();
+		cout << "Loaded " << mDataset.size() << " instances in " << omp_get_wtime() - load_start
+				<< " s; resident memory: " << ResidentMemory() / 1048576 << " MB" << endl;
+		if (PARAM_OBJ.mVerbose) mDatasetMatrix.OutputStatistics(cout);
+		mDatasetViewList.resize(mDatasetMatrix.NumRows());
+		for (unsigned i = 0; i < mDatasetMatrix.NumRows(); ++i)
+			mDatasetViewList[i] = mDatasetMatrix.Row(i);
+		if (PARAM_OBJ.mDenseEmbeddingSize > 0 && mSketchList.empty()) ComputeDenseEmbedding();
+	}
+
+	void ComputeDenseEmbedding() {
+		cout << "Computing dense embedding in " << PARAM_OBJ.mDenseEmbeddingSize << " dimensions" << endl;
+		mDenseEmbedding.Init(mDataset.size(), PARAM_OBJ.mDenseEmbeddingSize, PARAM_OBJ.mRandSeed);
+		#pragma omp parallel for schedule(dynamic,100)
+		for (unsigned i = 0; i < mDataset.size(); ++i) {
+			SVector buffer;
+			mDenseEmbedding.Set(i, InstanceView(i, buffer));
+		}
+		mDenseEmbedding.OutputStatistics(cout);
+	}
+
+	///Resident set size of the process in bytes (0 if not available)
+	static double ResidentMemory() {
+		ifstream fin("/proc/self/statm");
+		double size = 0, resident = 0;
+		if (!(fin >> size >> resident)) return 0;
+		return resident * sysconf(_SC_PAGESIZE);
+	}
+
+	void StoreInstance(const SVector& aX) {
+		//NOTE: all the placeholders in mDataset share the representation of a single empty vector
+		static const SVector empty_instance;
+		if (mCompressedDataset.IsActive()) mCompressedDataset.Add(aX);
+		else mDatasetMatrix.AddRow(aX);
+		mDataset.push_back(empty_instance);
+	}
+
+	///Returns a copy of an instance of the dataset, decoding it if the dataset is compressed
+	SVector Instance(unsigned aID) const {
+		if (!mCompressedDataset.IsActive()) {
+			//NOTE: with sketches (-oac) instances are not stored
+			if (aID >= mDatasetMatrix.NumRows()) return SVector();
+			return mDatasetMatrix.RowVector(aID);
+		}
+		SVector x;
+		mCompressedDataset.Decode(aID, x);
+		return x;
+	}
+
+	///Returns a view of an instance of the dataset; a compressed instance is decoded in oBuffer, which has to
+	///outlive the view
+	SVectorView InstanceView(unsigned aID, SVector& oBuffer) const {
+		if (!mCompressedDataset.IsActive()) {
+			if (aID < mDatasetMatrix.NumRows()) return mDatasetMatrix.Row(aID);
+			oBuffer.clear();
+			return oBuffer;
+		}
+		mCompressedDataset.Decode(aID, oBuffer);
+		return oBuffer;
+	}
+
+	///Kernel value between an arbitrary vector and an instance of the dataset
+	double QuerySimilarity(const SVectorView& aX, unsigned aID) {
+		if (mCompressedDataset.IsActive()) return mCompressedDataset.Dot(aX, aID);
+		return dot(aX, mDatasetViewList[aID]);
 	}
 
 //DirectProcess true=1 false=0 discard vector=2
@@ -428,7 +1558,7 @@ public:
 				} else if (aTypeOfProcess == "approximate") {
 					AddToBinDataStructure(x);
 				} else if (aTypeOfProcess == "memory") {
-					mDataset.push_back(x);
+					StoreInstance(x);
 				} else throw range_error("ERROR:Invalid load mode: <" + aTypeOfProcess + ">");
 				mIdMap.push_back(counter);
 			}
@@ -492,6 +1622,8 @@ public:
 				if (accept_flag == true) {
 					if (PARAM_OBJ.mOutputApproximateCluster) {
 						AddToBinDataStructure(x);
+					} else if (&oDataset == &mDataset) {
+						StoreInstance(x);
 					} else {
 						oDataset.push_back(x);
 					}
@@ -507,6 +1639,10 @@ public:
 	inline void ParseASCIILine2Vector(ifstream& aFin, SVector& aX) {
 		string line;
 		getline(aFin, line);
+		ParseASCIILine2Vector(line, aX);
+	}
+
+	inline void ParseASCIILine2Vector(const string& line, SVector& aX) {
 		if (line == "") return;
 		stringstream ss;
 		ss << line << endl;
@@ -656,47 +1792,126 @@ public:
 		ofstream of(ofname.c_str());
 		cout << "using num threads = "<< omp_get_max_threads()<< endl;
 		cout << "Computing bin data structure..." << endl;
-		ProgressBar progress_bar;
+		if (IsBanded())
+			cout << "Banded LSH: " << PARAM_OBJ.mNumBands << " bands x " << PARAM_OBJ.mNumRowsPerBand
+					<< " rows (similarity threshold ~"
+					<< ParameterWrapperClass::BandThreshold(PARAM_OBJ.mNumBands, PARAM_OBJ.mNumRowsPerBand)
+					<< ")" << endl;
+		{
+			ProgressBar progress_bar;
 
-		InitBinDataStructure();
-		//omp_set_num_threads(PARAM_OBJ.mThreads);
-		//fill structure
-		#pragma omp parallel for schedule(dynamic,10)
-		for (unsigned i = 0; i < mDataset.size(); ++i) {
-			vector<unsigned> min_list = ComputeHashSignature(i);
-			if (PARAM_OBJ.mOutputHashEncoding) {
-				for (unsigned j = 0; j < min_list.size(); j++)
-					of << min_list[j] << " ";
-				of << endl;
-			}
-			#pragma omp critical
-			{
-				for (unsigned k = 0; k < PARAM_OBJ.mNumHashFunctions; ++k) {
-					if (mBinDataStructure[k].count(min_list[k]) > 0) {
-						mBinDataStructure[k][min_list[k]].push_back(i);
-					} else {
-						vector<unsigned> tmp;
-						tmp.push_back(i);
-						mBinDataStructure[k].insert(make_pair(min_list[k], tmp));
+			InitBinDataStructure();
+			//omp_set_num_threads(PARAM_OBJ.mThreads);
+			//fill structure
+			#pragma omp parallel for schedule(dynamic,10)
+			for (unsigned i = 0; i < mDataset.size(); ++i) {
+				const vector<unsigned>& min_list = ComputeHashSignature(i);
+				if (PARAM_OBJ.mOutputHashEncoding) {
+					for (unsigned j = 0; j < min_list.size(); j++)
+						of << min_list[j] << " ";
+					of << endl;
+				}
+				#pragma omp critical
+				{
+					for (unsigned k = 0; k < NumBins(); ++k) {
+						if (mBinDataStructure[k].count(min_list[k]) > 0) {
+							mBinDataStructure[k][min_list[k]].push_back(i);
+						} else {
+							vector<unsigned> tmp;
+							tmp.push_back(i);
+							mBinDataStructure[k].insert(make_pair(min_list[k], tmp));
+						}
 					}
+					progress_bar.Count();
 				}
-				progress_bar.Count();
+				//	mBinDataStructure[k].insert(make_pair(min_list[k], i));
 			}
-			//	mBinDataStructure[k].insert(make_pair(min_list[k], i));
 		}
+		FilterBinDataStructure();
+	}
+
+	///Removes the bins that collect at least mMaxSizeBin * dataset size instances: they carry little
+	///information and would otherwise be scanned by every query that hits them. Collects bin statistics.
+	void FilterBinDataStructure() {
+		const double max_bin_size = PARAM_OBJ.mMaxSizeBin * mDataset.size();
+		mBinSizeHistogram.Clear();
+		mNumDroppedBinList.assign(mBinDataStructure.size(), 0);
+		mNumDroppedInstanceList.assign(mBinDataStructure.size(), 0);
+		for (unsigned k = 0; k < mBinDataStructure.size(); ++k) {
+			vector<unsigned> oversized_key_list;
+			for (umap_uint_vec_uint::const_iterator it = mBinDataStructure[k].begin();
+					it != mBinDataStructure[k].end(); ++it) {
+				unsigned bin_size = it->second.size();
+				mBinSizeHistogram.Insert(BinSizeClass(bin_size));
+				if (bin_size >= max_bin_size) {
+					oversized_key_list.push_back(it->first);
+					mNumDroppedInstanceList[k] += bin_size;
+				}
+			}
+			for (unsigned i = 0; i < oversized_key_list.size(); ++i)
+				mBinDataStructure[k].erase(oversized_key_list[i]);
+			mNumDroppedBinList[k] = oversized_key_list.size();
+		}
+		OutputBinDataStructureSummary();
+	}
+
+	///Returns the histogram class of a bin size, i.e. floor(log2(size))
+	static unsigned BinSizeClass(unsigned aBinSize) {
+		unsigned size_class = 0;
+		while (aBinSize >>= 1)
+			size_class++;
+		return size_class;
+	}
+
+	///Returns an estimate of the heap memory used by the bins of hash function aK (hash table and instance lists)
+	double BinDataStructureMemory(unsigned aK) const {
+		const umap_uint_vec_uint& bins = mBinDataStructure[aK];
+		double bytes = bins.bucket_count() * sizeof(void*);
+		for (umap_uint_vec_uint::const_iterator it = bins.begin(); it != bins.end(); ++it)
+			bytes += sizeof(umap_uint_vec_uint::value_type) + sizeof(void*)
+					+ it->second.capacity() * sizeof(unsigned);
+		return bytes;
+	}
+
+	void OutputBinDataStructureSummary() const {
+		unsigned num_dropped_bins = 0;
+		double num_dropped_instances = 0;
+		double memory = 0;
+		for (unsigned k = 0; k < mBinDataStructure.size(); ++k) {
+			num_dropped_bins += mNumDroppedBinList[k];
+			num_dropped_instances += mNumDroppedInstanceList[k];
+			memory += BinDataStructureMemory(k);
+		}
+		cout << "Bin size histogram (floor(log2(size)) : num bins): " << mBinSizeHistogram << endl;
+		cout << "Dropped " << num_dropped_bins << " bins of size >= " << PARAM_OBJ.mMaxSizeBin
+				<< " x " << mDataset.size() << " instances (" << num_dropped_instances
+				<< " entries); memory: " << memory / 1048576 << " MB total, "
+				<< (mBinDataStructure.size() > 0 ? memory / mBinDataStructure.size() / 1024 : 0)
+				<< " KB per hash function" << endl;
 	}
 
 	void InitBinDataStructure() {
 		//init structure
 		mBinDataStructure.clear();
-		for (unsigned k = 0; k < PARAM_OBJ.mNumHashFunctions; ++k)
+		for (unsigned k = 0; k < NumBins(); ++k)
 			mBinDataStructure.push_back(umap_uint_vec_uint());
 	}
 
+	///Returns true if min-hash values are collated in bands (i.e. one bin key per band rather than one per hash function)
+	inline bool IsBanded() const {
+		return PARAM_OBJ.mNumBands > 0;
+	}
+
+	///Returns the number of bins an instance is stored in (i.e. the length of its signature)
+	inline unsigned NumBins() const {
+		return IsBanded() ? PARAM_OBJ.mNumBands : PARAM_OBJ.mNumHashFunctions;
+	}
+
 	void AddToBinDataStructure(SVector& aX) {
 		static unsigned id_counter = 0;
 		vector<unsigned> min_list = ComputeHashSignature(aX, id_counter);
-		for (unsigned k = 0; k < PARAM_OBJ.mNumHashFunctions; ++k) {
+		mSketchList.push_back(min_list);
+		for (unsigned k = 0; k < NumBins(); ++k) {
 			if (mBinDataStructure[k].count(min_list[k]) > 0) {
 				mBinDataStructure[k][min_list[k]].push_back(id_counter);
 			} else {
@@ -709,47 +1924,112 @@ public:
 		mDataset.push_back(SVector());
 	}
 
-	inline vector<unsigned> ComputeHashSignature(unsigned aID) {
-		if (mSignatureMap.count(aID) > 0) return mSignatureMap[aID];
-		else {
-			vector<unsigned> signature = ComputeHashSignature(mDataset[aID], aID);
-			mSignatureMap[aID] = signature;
-			return signature;
+	//NOTE: the caches of signatures and neighborhoods are accessed under named critical sections as they are
+	//filled from within parallel loops; the values are computed outside of them. Entries are never replaced
+	//once inserted, and the nodes of an unordered_map do not move on rehash, so the references returned
+	//stay valid and callers can read them without copying
+	inline const vector<unsigned>& ComputeHashSignature(unsigned aID) {
+		if (aID < mSketchList.size()) return mSketchList[aID];
+		const vector<unsigned>* signature = NULL;
+		#pragma omp critical(signature_cache)
+		{
+			umap_uint_vec_uint::const_iterator it = mSignatureMap.find(aID);
+			if (it != mSignatureMap.end()) signature = &it->second;
+		}
+		if (signature == NULL) {
+			SVector buffer;
+			vector<unsigned> computed_signature = ComputeHashSignature(InstanceView(aID, buffer), aID);
+			#pragma omp critical(signature_cache)
+			signature = &mSignatureMap.insert(make_pair(aID, computed_signature)).first->second;
 		}
+		return *signature;
 	}
 
-	inline vector<unsigned> ComputeHashSignature(SVector& aX, unsigned aID) {
+	inline vector<unsigned> ComputeHashSignature(const SVectorView& aX, unsigned aID) {
+		if (IsBanded()) return ComputeBandedHashSignature(aX, aID);
 		unsigned effective_num_hash_functions = PARAM_OBJ.mNumHashFunctions * PARAM_OBJ.mHashFactor;
-		const unsigned MAXUNSIGNED = 2 << 30;
 		vector<unsigned> signature;
+		ComputeMinHashList(aX, aID, effective_num_hash_functions, signature);
+		//compact signature
+		vector<unsigned> compact_signature;
+		for (unsigned i = 0; i < PARAM_OBJ.mNumHashFunctions; ++i)
+			compact_signature.push_back(0);
+		for (unsigned i = 0; i < signature.size(); ++i) {
+			//add up several signatures to compose the new signature
+			compact_signature[i % PARAM_OBJ.mNumHashFunctions] += signature[i];
+		}
+		return compact_signature;
+	}
+
+	///Computes mNumBands x mNumRowsPerBand min-hash values and collates the rows of each band into a single
+	///key, so that two instances share a bin only if they agree on all the rows of that band
+	inline vector<unsigned> ComputeBandedHashSignature(const SVectorView& aX, unsigned aID) {
+		const unsigned num_bands = PARAM_OBJ.mNumBands;
+		const unsigned num_rows = PARAM_OBJ.mNumRowsPerBand;
+		vector<unsigned> signature;
+		ComputeMinHashList(aX, aID, num_bands * num_rows, signature);
+		vector<unsigned> band_signature(num_bands);
+		vector<unsigned> band(num_rows);
+		for (unsigned b = 0; b < num_bands; ++b) {
+			for (unsigned r = 0; r < num_rows; ++r)
+				band[r] = signature[b * num_rows + r];
+			band_signature[b] = HashFunc(band);
+		}
+		return band_signature;
+	}
+
+	///Fills oSignature with aNumHashFunctions min-hash values of the instance, either over the set of
+	///feature ids or, with -wmh, over the feature values (weighted min-hash)
+	inline void ComputeMinHashList(const SVectorView& aX, unsigned aID, unsigned aNumHashFunctions, vector<unsigned>& oSignature) {
+		const unsigned MAXUNSIGNED = 2 << 30;
 		//prepare a vector containing the k min values
-		for (unsigned k = 0; k < effective_num_hash_functions; ++k)
-			signature.push_back(MAXUNSIGNED);
-		unsigned size = (unsigned) aX.sparse_size();
+		oSignature.assign(aNumHashFunctions, MAXUNSIGNED);
+		vector<double> min_log_a;
+		if (PARAM_OBJ.mWeightedMinHash) min_log_a.assign(aNumHashFunctions, numeric_limits<double>::max());
+		const SVector::Pair* pairs = aX;
+		unsigned size = (unsigned) aX.npairs();
 		//for each element of the sparse vector
 		for (unsigned f = 0; f < size; ++f) {
-			//extract only the feature id (i.e. ignore the actial value)
-			unsigned hash_id = aX.extract_component(f).first;
+			unsigned hash_id = pairs[f].i;
 			if (hash_id == 0) {
 				//feature is should not be 0 as the subsequent rehashing can encounter problems
 				cout << "In sequence with id: " << mIdMap[aID] << endl; /////
 				cout << "Warning: Feature ID = 0. Feature ID  should be strictly > 0" << endl;
 				hash_id = 1; //force collision between feature 0 and 1
 			}
-			for (unsigned k = 0; k < effective_num_hash_functions; ++k) { //for all k hashes
-				unsigned new_hash = IntHash(hash_id, MAXUNSIGNED, k); //rehash the feature id with a procedure that is aware of the index k
-				if (signature[k] > new_hash) signature[k] = new_hash; //keep the minimum value only
+			if (PARAM_OBJ.mWeightedMinHash) {
+				if (pairs[f].v <= 0) continue; //only strictly positive weights can be sampled
+				UpdateWeightedMinHashList(hash_id, log((double) pairs[f].v), min_log_a, oSignature);
+			} else {
+				//extract only the feature id (i.e. ignore the actial value)
+				for (unsigned k = 0; k < aNumHashFunctions; ++k) { //for all k hashes
+					unsigned new_hash = IntHash(hash_id, MAXUNSIGNED, k); //rehash the feature id with a procedure that is aware of the index k
+					if (oSignature[k] > new_hash) oSignature[k] = new_hash; //keep the minimum value only
+				}
 			}
 		}
-		//compact signature
-		vector<unsigned> compact_signature;
-		for (unsigned i = 0; i < PARAM_OBJ.mNumHashFunctions; ++i)
-			compact_signature.push_back(0);
-		for (unsigned i = 0; i < signature.size(); ++i) {
-			//add up several signatures to compose the new signature
-			compact_signature[i % PARAM_OBJ.mNumHashFunctions] += signature[i];
+	}
+
+	///Improved consistent weighted sampling (Ioffe, 2010): for each hash function k, feature i with weight S
+	///draws r,c ~ Gamma(2,1) and b ~ U(0,1) as deterministic functions of (i,k) and computes t=floor(ln(S)/r+b),
+	///ln(a)=ln(c)-r(t-b+1); the sample (i,t) with the smallest a is kept. Two instances obtain the same sample with
+	///probability equal to their weighted (min-max) jaccard similarity.
+	inline void UpdateWeightedMinHashList(	unsigned aHashID,
+											double aLogWeight,
+											vector<double>& oMinLogAList,
+											vector<unsigned>& oSignature) {
+		const unsigned MAXUNSIGNED = 2 << 30;
+		for (unsigned k = 0; k < oSignature.size(); ++k) {
+			double r = -log(HashUnit(aHashID, k, 0) * HashUnit(aHashID, k, 1));
+			double c = -log(HashUnit(aHashID, k, 2) * HashUnit(aHashID, k, 3));
+			double beta = HashUnit(aHashID, k, 4);
+			double t = floor(aLogWeight / r + beta);
+			double log_a = log(c) - r * (t - beta + 1);
+			if (log_a < oMinLogAList[k]) {
+				oMinLogAList[k] = log_a;
+				oSignature[k] = (unsigned) (HashMix(aHashID, (unsigned) (int) t, k) % MAXUNSIGNED);
+			}
 		}
-		return compact_signature;
 	}
 
 	inline vector<unsigned> ComputeHashSignatureNatural(SVector& aX) {
@@ -772,24 +2052,181 @@ public:
 				new_hash += signature[i + j];
 			compact_signature.push_back(new_hash);
 		}
-		return compact_signature;
+		return compact_signature;
+	}
+
+	///Loads the bin data structure from PARAM_OBJ.mIndexFileName if available, otherwise computes it (and
+	///saves it if a file name is given)
+	void PrepareBinDataStructure() {
+		if (!mBinDataStructure.empty()) return; //NOTE: already prepared (e.g. to build the kNN graph)
+		if (PARAM_OBJ.mIndexFileName != "") {
+			ifstream fin(PARAM_OBJ.mIndexFileName.c_str(), ios::binary);
+			if (fin) {
+				cout << "Reading bin data structure from " << PARAM_OBJ.mIndexFileName << endl;
+				LoadBinDataStructure(fin);
+				FilterBinDataStructure();
+				return;
+			}
+		}
+		ComputeBinDataStructure();
+		if (PARAM_OBJ.mIndexFileName != "") {
+			cout << "Writing bin data structure to " << PARAM_OBJ.mIndexFileName << endl;
+			ofstream ofs(PARAM_OBJ.mIndexFileName.c_str(), ios::binary);
+			if (!ofs) throw range_error("Cannot open file:" + PARAM_OBJ.mIndexFileName);
+			SaveBinDataStructure(ofs);
+		}
+	}
+
+	///Returns the data (through its checksum) and the parameters that determine the content of the bin data
+	///structure, i.e. those of the signatures and the size from which bins are dropped
+	vector<unsigned> BinDataStructureHeader() const {
+		vector<unsigned> header;
+		header.push_back(BIN_DATA_STRUCTURE_FORMAT_VERSION);
+		header.push_back(mDataset.size());
+		header.push_back(NumBins());
+		header.push_back(PARAM_OBJ.mNumHashFunctions);
+		header.push_back(PARAM_OBJ.mHashFactor);
+		header.push_back(PARAM_OBJ.mNumBands);
+		header.push_back(PARAM_OBJ.mNumRowsPerBand);
+		header.push_back(PARAM_OBJ.mWeightedMinHash);
+		header.push_back((unsigned) min(ceil(PARAM_OBJ.mMaxSizeBin * mDataset.size()), mDataset.size() + 1.0));
+		unsigned long long checksum = DatasetChecksum();
+		header.push_back((unsigned) checksum);
+		header.push_back((unsigned) (checksum >> 32));
+		return header;
+	}
+
+	void SaveBinDataStructure(ostream& out) const {
+		vector<unsigned> header = BinDataStructureHeader();
+		unsigned header_size = header.size();
+		out.write((const char*) &header_size, sizeof(unsigned));
+		out.write((const char*) &header[0], sizeof(unsigned) * header_size);
+		for (unsigned k = 0; k < mBinDataStructure.size(); ++k) {
+			unsigned num_bins = mBinDataStructure[k].size();
+			out.write((const char*) &num_bins, sizeof(unsigned));
+			for (umap_uint_vec_uint::const_iterator it = mBinDataStructure[k].begin();
+					it != mBinDataStructure[k].end(); ++it) {
+				unsigned key = it->first;
+				unsigned bin_size = it->second.size();
+				out.write((const char*) &key, sizeof(unsigned));
+				out.write((const char*) &bin_size, sizeof(unsigned));
+				out.write((const char*) &it->second[0], sizeof(unsigned) * bin_size);
+			}
+		}
+		if (!out.good()) throw range_error("ERROR:Cannot write bin data structure");
+	}
+
+	void LoadBinDataStructure(istream& in) {
+		vector<unsigned> header = BinDataStructureHeader();
+		unsigned header_size = 0;
+		in.read((char*) &header_size, sizeof(unsigned));
+		//NOTE: sizes read from the file are checked before they are used to allocate anything
+		vector<unsigned> file_header;
+		if (in.good() && header_size == header.size()) {
+			file_header.resize(header_size);
+			in.read((char*) &file_header[0], sizeof(unsigned) * header_size);
+		}
+		if (!in.good() || file_header != header)
+			throw range_error(
+					"ERROR:Bin data structure in file <" + PARAM_OBJ.mIndexFileName
+							+ "> was built with different data or parameters");
+		const string corrupt_message = "ERROR:Truncated or corrupt bin data structure in file <"
+				+ PARAM_OBJ.mIndexFileName + ">";
+		const unsigned data_size = mDataset.size();
+		InitBinDataStructure();
+		for (unsigned k = 0; k < mBinDataStructure.size(); ++k) {
+			unsigned num_bins = 0;
+			in.read((char*) &num_bins, sizeof(unsigned));
+			if (!in.good() || num_bins > data_size) throw range_error(corrupt_message);
+			for (unsigned b = 0; b < num_bins; ++b) {
+				unsigned key = 0, bin_size = 0;
+				in.read((char*) &key, sizeof(unsigned));
+				in.read((char*) &bin_size, sizeof(unsigned));
+				if (!in.good() || bin_size > data_size) throw range_error(corrupt_message);
+				vector<unsigned>& bin = mBinDataStructure[k][key];
+				bin.resize(bin_size);
+				if (bin_size > 0) in.read((char*) &bin[0], sizeof(unsigned) * bin_size);
+				if (!in.good()) throw range_error(corrupt_message);
+				for (unsigned t = 0; t < bin_size; ++t)
+					if (bin[t] >= data_size) throw range_error(corrupt_message);
+			}
+		}
+	}
+
+	///Answers approximate k-nearest neighbour queries for instances that are not part of the dataset: for
+	///each query line the ids (1 based, as in the input file) of the most similar instances are returned with
+	///their kernel value. Queries are read in batches (up to an empty line) and each batch is processed in parallel.
+	void ServeQueries(istream& in, ostream& out) {
+		const unsigned MAX_BATCH_SIZE = 1024;
+		while (in.good()) {
+			vector<string> query_list;
+			string line;
+			while (query_list.size() < MAX_BATCH_SIZE && getline(in, line)) {
+				if (line == "" || line == "\r") {
+					if (query_list.size() > 0) break;
+				} else query_list.push_back(line);
+			}
+			if (query_list.size() == 0) continue;
+			vector<string> answer_list(query_list.size());
+			#pragma omp parallel for schedule(dynamic,10)
+			for (unsigned q = 0; q < query_list.size(); ++q) {
+				SVector x;
+				ParseASCIILine2Vector(query_list[q], x);
+				vector<pair<double, unsigned> > rank_list;
+				if (InstanceIsValid(x)) QueryApproximateNeighborhood(x, rank_list);
+				stringstream ss;
+				for (unsigned t = 0; t < rank_list.size(); ++t)
+					ss << mIdMap[rank_list[t].second] << ":" << -rank_list[t].first << " ";
+				answer_list[q] = ss.str();
+			}
+			for (unsigned q = 0; q < answer_list.size(); ++q)
+				out << answer_list[q] << "\n";
+			out << flush;
+			if (!out.good()) return; //the client went away (e.g. EPIPE): drop the connection
+		}
+	}
+
+	void ServeSocket(const string& aSocketFileName) {
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) throw range_error("ERROR:Cannot create socket");
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (aSocketFileName.size() >= sizeof(address.sun_path))
+			throw range_error("ERROR:Socket file name too long:" + aSocketFileName);
+		strcpy(address.sun_path, aSocketFileName.c_str());
+		unlink(aSocketFileName.c_str());
+		if (bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(fd, 16) != 0)
+			throw range_error("ERROR:Cannot listen on socket:" + aSocketFileName);
+		//NOTE: a client that closes its end before reading the answers must only cost its own connection, hence
+		//writes to it fail with EPIPE instead of raising SIGPIPE
+		signal(SIGPIPE, SIG_IGN);
+		cout << "Serving approximate k-nearest neighbour queries on " << aSocketFileName << endl;
+		for (;;) {
+			int connection_fd = accept(fd, 0, 0);
+			if (connection_fd < 0) {
+				if (errno == EINTR) continue;
+				throw range_error("ERROR:Cannot accept connection on socket:" + aSocketFileName);
+			}
+			{
+				FdStreamBuf buffer(connection_fd);
+				iostream connection(&buffer);
+				ServeQueries(connection, connection);
+			}
+			close(connection_fd);
+		}
 	}
 
 	void OutputBinDataStructureStatistics() const {
-		VectorClass bin_size_stats, bin_type_stats;
+		VectorClass bin_size_stats, bin_type_stats, bin_memory_stats, bin_dropped_stats;
 
 		for (unsigned k = 0; k < mBinDataStructure.size(); ++k) {
-			unsigned bin_type_counter = 0;
 			for (umap_uint_vec_uint::const_iterator it =
-					mBinDataStructure[k].begin(); it != mBinDataStructure[k].end(); ++it) {
-				//unsigned key = it->first;
-				vector<unsigned> dat = it->second;
-				unsigned bin_size = dat.size();
-				//unsigned  bin_size = mBinDataStructure[k][key].size();
-				bin_size_stats.PushBack(bin_size);
-				bin_type_counter++;
-			}
-			bin_type_stats.PushBack(bin_type_counter);
+					mBinDataStructure[k].begin(); it != mBinDataStructure[k].end(); ++it)
+				bin_size_stats.PushBack(it->second.size());
+			bin_type_stats.PushBack(mBinDataStructure[k].size());
+			bin_memory_stats.PushBack(BinDataStructureMemory(k));
+			bin_dropped_stats.PushBack(mNumDroppedBinList[k]);
 		}
 
 		cout << "Num bins statistics: ";
@@ -798,56 +2235,85 @@ public:
 		cout << "Size bins statistics: ";
 		bin_size_stats.OutputStatistics(cout);
 		cout << endl;
+		cout << "Num dropped bins statistics: ";
+		bin_dropped_stats.OutputStatistics(cout);
+		cout << endl;
+		cout << "Memory (bytes) per hash function statistics: ";
+		bin_memory_stats.OutputStatistics(cout);
+		cout << endl;
 	}
 
+	//NOTE: overwrites the cached neighborhood of aID; only call it outside of parallel regions and while no
+	//reference to that entry is held
 	vector<unsigned> ComputeApproximateNeighborhood(unsigned aID, unsigned aSize) {
 //			if (mApproximateNeighborhoodMap.count(aID) == 0) {
-				vector<unsigned> hash_signature = ComputeHashSignature(aID);
+				const vector<unsigned>& hash_signature = ComputeHashSignature(aID);
 				vector<unsigned> neighborhood = ComputeApproximateNeighborhood(hash_signature,aSize);
 				//select neighborhood under true similarity function on the subset of indiced returned by ComputeApproximateNeighborhood
 				vector<unsigned> true_neighborhood = ComputeTrueSubNeighborhood(aID, neighborhood, aSize);
 
+				#pragma omp critical(neighborhood_cache)
 				mApproximateNeighborhoodMap[aID] = true_neighborhood;
 //			}
-			return mApproximateNeighborhoodMap[aID];
+			return true_neighborhood;
 		}
 
 
-	vector<unsigned> ComputeApproximateNeighborhood(unsigned aID) {
-		if (mApproximateNeighborhoodMap.count(aID) == 0) {
-			vector<unsigned> hash_signature = ComputeHashSignature(aID);
+	const vector<unsigned>& ComputeApproximateNeighborhood(unsigned aID) {
+		if (!mKNNGraph.empty()) return mKNNGraph[aID];
+		const vector<unsigned>* true_neighborhood = NULL;
+		#pragma omp critical(neighborhood_cache)
+		{
+			umap_uint_vec_uint::const_iterator it = mApproximateNeighborhoodMap.find(aID);
+			if (it != mApproximateNeighborhoodMap.end()) true_neighborhood = &it->second;
+		}
+		if (true_neighborhood == NULL) {
+			const vector<unsigned>& hash_signature = ComputeHashSignature(aID);
 			unsigned aSize = PARAM_OBJ.mEccessNeighbourSizeFactor * PARAM_OBJ.mNumNearestNeighbors;
 			vector<unsigned> neighborhood = ComputeApproximateNeighborhood(hash_signature,aSize);
 			//select neighborhood under true similarity function on the subset of indiced returned by ComputeApproximateNeighborhood
-			vector<unsigned> true_neighborhood = ComputeTrueSubNeighborhood(aID, neighborhood);
+			vector<unsigned> computed_neighborhood = ComputeTrueSubNeighborhood(aID, neighborhood);
 
-			mApproximateNeighborhoodMap[aID] = true_neighborhood;
+			#pragma omp critical(neighborhood_cache)
+			true_neighborhood = &mApproximateNeighborhoodMap.insert(make_pair(aID, computed_neighborhood)).first->second;
 		}
-		return mApproximateNeighborhoodMap[aID];
+		return *true_neighborhood;
 	}
 
 	vector<unsigned> ComputeApproximateNeighborhood(const vector<unsigned>& aInstanceSignature, unsigned aSize) {
-		umap_uint_int neighborhood;
-		vector<pair<unsigned, double> > vec;
-		for (unsigned k = 0; k < PARAM_OBJ.mNumHashFunctions; ++k) {
+		//NOTE: each thread counts collisions in its own dense counter; bins are only read
+		CollisionCounterClass& neighborhood = mCollisionCounterList[omp_get_thread_num()];
+		neighborhood.Begin(mDataset.size());
+		for (unsigned k = 0; k < NumBins(); ++k) {
 			unsigned hash_id = aInstanceSignature[k];
-			unsigned collision_size = mBinDataStructure[k][hash_id].size();
-
-			if (collision_size < PARAM_OBJ.mMaxSizeBin * mDataset.size()) {
-				//fill neighborhood set counting number of occurrences
-				for (vector<unsigned>::iterator it = mBinDataStructure[k][hash_id].begin();
-						it != mBinDataStructure[k][hash_id].end(); ++it) {
-					unsigned instance_id = *it;
-					if (neighborhood.count(instance_id) > 0) neighborhood[instance_id]++;
-					else neighborhood[instance_id] = 1;
-				}
-			} else {
-				//mBinDataStructure[k].erase(hash_id);
-			}
+			umap_uint_vec_uint::const_iterator bin = mBinDataStructure[k].find(hash_id);
+			//NOTE: oversized bins have already been removed by FilterBinDataStructure
+			if (bin == mBinDataStructure[k].end()) continue;
+			const vector<unsigned>& collision_list = bin->second;
+			//fill neighborhood set counting number of occurrences
+			for (unsigned i = 0; i < collision_list.size(); ++i)
+				neighborhood.Increment(collision_list[i]);
 		}
 		// trims neighbh acc to mEccessNeighbourSizeFactor, if 0 no trim
 		// but sorted to bins_in_common counts
-		return TrimNeighborhood(neighborhood,aSize);
+		vector<unsigned> neighborhood_list = TrimNeighborhood(neighborhood, aSize);
+		unsigned candidate_size = neighborhood.Touched().size();
+		#pragma omp critical(candidate_statistics)
+		{
+			mNumCandidateQueries++;
+			mCandidateSizeSum += candidate_size;
+			mCandidateSizeMax = max(mCandidateSizeMax, candidate_size);
+			mTrimmedCandidateSizeSum += neighborhood_list.size();
+		}
+		return neighborhood_list;
+	}
+
+	void OutputCandidateStatistics() const {
+		if (mNumCandidateQueries == 0) return;
+		cout << "Approximate neighborhood queries: " << mNumCandidateQueries << " probing " << NumBins()
+				<< " bins each; candidate set size avg: " << mCandidateSizeSum / mNumCandidateQueries
+				<< " max: " << mCandidateSizeMax << " after trimming avg: "
+				<< mTrimmedCandidateSizeSum / mNumCandidateQueries << endl;
 	}
 
 	vector<unsigned> ComputeTrueSubNeighborhood(unsigned aID,
@@ -874,7 +2340,7 @@ public:
 			vector<pair<double, unsigned> > rank_list;
 			for (unsigned i = 0; i < aApproximateNeighborhoodList.size(); ++i) {
 				unsigned id_neighbour = aApproximateNeighborhoodList[i];
-				double k = Kernel(aID, id_neighbour);
+				double k = mDenseEmbedding.IsActive() ? mDenseEmbedding.Dot(aID, id_neighbour) : Kernel(aID, id_neighbour);
 				rank_list.push_back(make_pair(-k, id_neighbour));
 			}
 			unsigned effective_size = 0;
@@ -884,6 +2350,14 @@ public:
 				effective_size = rank_list.size();
 			}
 			sort(rank_list.begin(), rank_list.end());
+			if (mDenseEmbedding.IsActive() && PARAM_OBJ.mDenseEmbeddingRerankFactor > 0) {
+				//re-rank the shortlist of the best neighbours under the embedding with the exact kernel
+				unsigned shortlist_size = min((unsigned) rank_list.size(),
+						effective_size * PARAM_OBJ.mDenseEmbeddingRerankFactor);
+				for (unsigned j = 0; j < shortlist_size; j++)
+					rank_list[j].first = -Kernel(aID, rank_list[j].second);
+				sort(rank_list.begin(), rank_list.begin() + shortlist_size);
+			}
 			//cout <<"es: " <<  effective_size << " aSize " <<  aApproximateNeighborhoodList.size()<< endl;
 			for (unsigned j = 0; j < effective_size; j++) {
 				neighbor.push_back(rank_list[j].second);
@@ -898,18 +2372,86 @@ public:
 		return neighbor;
 	}
 
+	///Approximate neighborhood of an instance that is not part of the dataset, returned as (-kernel, id)
+	///pairs in decreasing order of similarity. Does not touch any cache so it can be called concurrently.
+	void QueryApproximateNeighborhood(SVector& aX, vector<pair<double, unsigned> >& oRankList) {
+		vector<unsigned> hash_signature = ComputeHashSignature(aX, 0);
+		unsigned size = PARAM_OBJ.mEccessNeighbourSizeFactor * PARAM_OBJ.mNumNearestNeighbors;
+		vector<unsigned> neighborhood = ComputeApproximateNeighborhood(hash_signature, size);
+		oRankList.clear();
+		for (unsigned i = 0; i < neighborhood.size(); ++i) {
+			double k = PARAM_OBJ.mTrueSort ? QuerySimilarity(aX, neighborhood[i]) : 0;
+			oRankList.push_back(make_pair(-k, neighborhood[i]));
+		}
+		unsigned effective_size = min((unsigned) oRankList.size(), PARAM_OBJ.mNumNearestNeighbors);
+		if (PARAM_OBJ.mTrueSort)
+			partial_sort(oRankList.begin(), oRankList.begin() + effective_size, oRankList.end());
+		else //keep the bin collision order but still report the kernel value
+			for (unsigned i = 0; i < effective_size; ++i)
+				oRankList[i].first = -QuerySimilarity(aX, oRankList[i].second);
+		oRankList.resize(effective_size);
+	}
+
 	vector<unsigned> ComputeTrueNeighborhood(unsigned aID) {
-		const SVector& x = mDataset[aID];
-		return ComputeTrueNeighborhood(x);
+		if (IsBoundPruningActive() || !mSketchList.empty()) {
+			vector<pair<double, unsigned> > heap;
+			unsigned effective_size = min((unsigned) mDataset.size(), PARAM_OBJ.mNumNearestNeighbors);
+			if (IsBoundPruningActive()) BoundedTopK(aID, effective_size, heap);
+			else //with sketches (-oac) instances are only known through their sketch similarity
+				for (unsigned v = 0; v < mDataset.size(); v++)
+					PushTopK(heap, effective_size, make_pair(-Similarity(aID, v), v));
+			sort_heap(heap.begin(), heap.end());
+			vector<unsigned> neighbor;
+			for (unsigned j = 0; j < heap.size(); j++)
+				neighbor.push_back(heap[j].second);
+			return neighbor;
+		}
+		SVector buffer;
+		return ComputeTrueNeighborhood(InstanceView(aID, buffer));
 	}
 
-	vector<unsigned> ComputeTrueNeighborhood(const SVector& aX) {
-		vector<pair<double, unsigned> > rank_list;
-		for (unsigned i = 0; i < mDataset.size(); ++i) {
-			double k = dot(aX, mDataset[i]);
-			rank_list.push_back(make_pair(-k, i));
+	vector<unsigned> ComputeTrueNeighborhood(const SVectorView& aX) {
+		if (IsBoundPruningActive()) {
+			vector<pair<double, unsigned> > heap;
+			BoundedTopK(aX, min((unsigned) mDataset.size(), PARAM_OBJ.mNumNearestNeighbors), heap);
+			sort_heap(heap.begin(), heap.end());
+			vector<unsigned> neighbor;
+			for (unsigned j = 0; j < heap.size(); j++)
+				neighbor.push_back(heap[j].second);
+			return neighbor;
 		}
-		unsigned effective_size = min((unsigned) rank_list.size(), PARAM_OBJ.mNumNearestNeighbors);
+		if (mInvertedIndex.empty()) { //fall back to the exhaustive scan
+			vector<double> value_list(mDataset.size());
+			if (mCompressedDataset.IsActive()) {
+				for (unsigned i = 0; i < mDataset.size(); ++i)
+					value_list[i] = QuerySimilarity(aX, i);
+			} else mDatasetMatrix.Dot(aX, 0, mDataset.size(), value_list);
+			vector<pair<double, unsigned> > rank_list;
+			for (unsigned i = 0; i < mDataset.size(); ++i)
+				rank_list.push_back(make_pair(-value_list[i], i));
+			unsigned effective_size = min((unsigned) rank_list.size(), PARAM_OBJ.mNumNearestNeighbors);
+			partial_sort(rank_list.begin(), rank_list.begin() + effective_size, rank_list.end());
+			vector<unsigned> neighbor;
+			for (unsigned j = 0; j < effective_size; j++)
+				neighbor.push_back(rank_list[j].second);
+			return neighbor;
+		}
+		ScoreAccumulatorClass& score = mScoreAccumulatorList[omp_get_thread_num()];
+		unsigned effective_size = min((unsigned) mDataset.size(), PARAM_OBJ.mNumNearestNeighbors);
+		AccumulateInvertedIndexScores(aX, effective_size, score);
+		//rank touched instances; instances that share no feature have kernel 0 and enter the ranking in
+		//increasing id order, hence at most effective_size of them need to be considered
+		vector<pair<double, unsigned> >& rank_list = score.mRankList;
+		rank_list.clear();
+		const vector<unsigned>& touched = score.Touched();
+		for (unsigned i = 0; i < touched.size(); ++i)
+			rank_list.push_back(make_pair(-score.Count(touched[i]), touched[i]));
+		for (unsigned i = 0, num_zero = 0; i < mDataset.size() && num_zero < effective_size; ++i)
+			if (!score.IsTouched(i)) {
+				rank_list.push_back(make_pair(-0.0, i));
+				num_zero++;
+			}
+		effective_size = min((unsigned) rank_list.size(), effective_size);
 		partial_sort(rank_list.begin(), rank_list.begin() + effective_size, rank_list.end());
 		vector<unsigned> neighbor;
 		for (unsigned j = 0; j < effective_size; j++)
@@ -917,62 +2459,116 @@ public:
 		return neighbor;
 	}
 
-	vector<unsigned> TrimNeighborhood(umap_uint_int& aNeighborhood, unsigned aSize) {
-		const int MIN_BINS_IN_COMMON = 2; //Minimum number of bins that two instances have to have in common in order to be considered similar
+	///Builds the inverted index of the dataset, i.e. for each feature the list of instances with a non zero
+	///value for it, so that exact kernel values between a query and all instances can be accumulated
+	///visiting only the instances that share at least one feature with the query
+	void ComputeInvertedIndex() {
+		cout << "Computing inverted index for " << mDataset.size() << " instances" << endl;
+		mInvertedIndex.clear();
+		mInvertedIndexIsNonNegative = true;
+		double num_postings = 0;
+		for (unsigned i = 0; i < mDataset.size(); ++i) {
+			SVector buffer;
+			for (const SVector::Pair* p = InstanceView(i, buffer); p && p->i >= 0; p++) {
+				PostingListClass& posting_list = mInvertedIndex[p->i];
+				posting_list.mIDList.push_back(i);
+				posting_list.mValueList.push_back(p->v);
+				posting_list.mMaxValue = max(posting_list.mMaxValue, (double) p->v);
+				if (p->v < 0) mInvertedIndexIsNonNegative = false;
+				num_postings++;
+			}
+		}
+		cout << "Inverted index: " << mInvertedIndex.size() << " features " << num_postings << " postings"
+				<< endl;
+	}
+
+	///Accumulates in oScore the kernel values between aX and all the instances that share features with it.
+	///Features are visited in increasing id order, so that each value is summed exactly as in dot(). With -mset
+	///and non negative values, once the largest score that an instance not yet touched could still reach
+	///(sum over the remaining features of query value times max value) falls below the aK-th largest partial
+	///score, no new instance can enter the top aK and only the already touched instances are updated.
+	void AccumulateInvertedIndexScores(const SVectorView& aX, unsigned aK, ScoreAccumulatorClass& oScore) {
+		oScore.Begin(mDataset.size());
+		vector<const PostingListClass*> posting_list_list;
+		vector<double> query_value_list;
+		bool query_is_non_negative = true;
+		for (const SVector::Pair* p = aX; p && p->i >= 0; p++) {
+			umap_uint_posting::const_iterator it = mInvertedIndex.find(p->i);
+			if (it == mInvertedIndex.end()) continue;
+			posting_list_list.push_back(&it->second);
+			query_value_list.push_back(p->v);
+			if (p->v < 0) query_is_non_negative = false;
+		}
+		//NOTE: partial scores are lower bounds of the final ones only if both the index and the query values are
+		//non negative; otherwise the score of a touched instance can still drop below the k-th one
+		bool use_bounds = PARAM_OBJ.mMaxScoreEarlyTermination && mInvertedIndexIsNonNegative && query_is_non_negative
+				&& aK > 0;
+		//remaining_bound_list[f] is an upper bound on the score obtainable from features f,f+1,...
+		vector<double> remaining_bound_list(posting_list_list.size() + 1, 0);
+		for (unsigned f = posting_list_list.size(); use_bounds && f-- > 0;)
+			remaining_bound_list[f] = remaining_bound_list[f + 1]
+					+ query_value_list[f] * posting_list_list[f]->mMaxValue;
+		bool admit_new = true;
+		const unsigned CHECK_PERIOD = 8;
+		for (unsigned f = 0; f < posting_list_list.size(); ++f) {
+			if (use_bounds && admit_new && f > 0 && f % CHECK_PERIOD == 0 && oScore.Touched().size() >= aK) {
+				double threshold = KthLargestScore(oScore, aK);
+				if (remaining_bound_list[f] < threshold) admit_new = false;
+			}
+			const PostingListClass& posting_list = *posting_list_list[f];
+			double query_value = query_value_list[f];
+			for (unsigned j = 0; j < posting_list.mIDList.size(); ++j) {
+				unsigned id = posting_list.mIDList[j];
+				if (admit_new || oScore.IsTouched(id))
+					oScore.Add(id, query_value * (double) posting_list.mValueList[j]);
+			}
+		}
+	}
+
+	double KthLargestScore(ScoreAccumulatorClass& aScore, unsigned aK) {
+		vector<pair<double, unsigned> >& rank_list = aScore.mRankList;
+		rank_list.clear();
+		const vector<unsigned>& touched = aScore.Touched();
+		for (unsigned i = 0; i < touched.size(); ++i)
+			rank_list.push_back(make_pair(-aScore.Count(touched[i]), touched[i]));
+		nth_element(rank_list.begin(), rank_list.begin() + aK - 1, rank_list.end());
+		return -rank_list[aK - 1].first;
+	}
+
+	vector<unsigned> TrimNeighborhood(CollisionCounterClass& aNeighborhood, unsigned aSize) {
+		//Minimum number of bins that two instances have to have in common in order to be considered similar
+		//NOTE: in banded mode a single shared band already implies agreement on all its rows
+		const int MIN_BINS_IN_COMMON = IsBanded() ? 1 : 2;
 		//given a list of neighbours with an associated occurences count, return only a fraction of the highest count ones
-		vector<unsigned> neighborhood_list;
-		//if (PARAM_OBJ.mEccessNeighbourSizeFactor > 0) {
-		if (aSize > 0) {
-			//sort by num occurences
-			vector<pair<int, unsigned> > count_list;
-			for (umap_uint_int::const_iterator it = aNeighborhood.begin();
-					it != aNeighborhood.end(); ++it) {
-				unsigned id = it->first;
-				int count = it->second;
-				if (count >= MIN_BINS_IN_COMMON) //NOTE: consider instances that have at least MIN_BINS_IN_COMMON
-					count_list.push_back(make_pair(-count, id)); //NOTE:-count to sort from highest to lowest
-			}
-			sort(count_list.begin(), count_list.end());
-
-//			unsigned effective_size = min((unsigned) count_list.size(),(unsigned) (PARAM_OBJ.mEccessNeighbourSizeFactor * PARAM_OBJ.mNumNearestNeighbors));
-			unsigned effective_size = min((unsigned) count_list.size(),aSize);
-			for (unsigned i = 0; i < effective_size; ++i)
-				neighborhood_list.push_back(count_list[i].second);
-
-			// steffen: check if we only have same bin-counts in trimmed neighborhood
-			// --> this is reason that timmen nh by chance does not contain itself as ordering
-			// is arbitrary for similar counts
-			//
-			//if ( !count_list.empty() && count_list[0].first == count_list[effective_size].first ){
-			//	cout << "strange first last has same count " <<  count_list[0].first << "effsize "<< effective_size << " size " << count_list.size()<<endl;
-			//}
-
-
-		} else { //if mEccessNeighbourSizeFactor==0 then just consider all the ids in the approximate neighborhood
-			vector<pair<int, unsigned> > count_list;
-			for (umap_uint_int::const_iterator it = aNeighborhood.begin();
-				it != aNeighborhood.end(); ++it) {
-				unsigned id = it->first;
-				int count = it->second;
-				if (count >= MIN_BINS_IN_COMMON) //NOTE: consider instances that have at least MIN_BINS_IN_COMMON
-					count_list.push_back(make_pair(-count, id)); //NOTE:-count to sort from highest to lowest
-			}
-			sort(count_list.begin(), count_list.end());
-			for (unsigned i = 0; i < count_list.size(); ++i)
-				neighborhood_list.push_back(count_list[i].second);
-
-//				for (umap_uint_int::const_iterator it = aNeighborhood.begin();
-//					it != aNeighborhood.end(); ++it) {
-//					neighborhood_list.push_back(it->first);
-//				}
+		vector<pair<int, unsigned> >& count_list = aNeighborhood.mRankList;
+		count_list.clear();
+		const vector<unsigned>& touched = aNeighborhood.Touched();
+		for (unsigned i = 0; i < touched.size(); ++i) {
+			unsigned id = touched[i];
+			int count = aNeighborhood.Count(id);
+			if (count >= MIN_BINS_IN_COMMON) //NOTE: consider instances that have at least MIN_BINS_IN_COMMON
+				count_list.push_back(make_pair(-count, id)); //NOTE:-count to sort from highest to lowest
 		}
+		//if mEccessNeighbourSizeFactor==0 (i.e. aSize==0) then just consider all the ids in the approximate neighborhood
+		unsigned effective_size = count_list.size();
+		if (aSize > 0 && aSize < effective_size) {
+			//only the aSize highest counts are needed: select them first and then sort only those
+			//NOTE: ties are broken by id, so the result is the same prefix a full sort would give
+			effective_size = aSize;
+			nth_element(count_list.begin(), count_list.begin() + effective_size, count_list.end());
+		}
+		sort(count_list.begin(), count_list.begin() + effective_size);
+		vector<unsigned> neighborhood_list;
+		neighborhood_list.reserve(effective_size);
+		for (unsigned i = 0; i < effective_size; ++i)
+			neighborhood_list.push_back(count_list[i].second);
 		return neighborhood_list;
 	}
 
 	double ComputeApproximateDensity(unsigned aID) {
 		double density = 0;
 		unsigned i = aID;
-		vector<unsigned> approximate_neighborhood = ComputeApproximateNeighborhood(i);
+		const vector<unsigned>& approximate_neighborhood = ComputeApproximateNeighborhood(i);
 		if (mApproximateDensityMap[i] == -1) {
 			if (PARAM_OBJ.mFullDensityEstimation == true) {
 				for (unsigned it = 0; it < approximate_neighborhood.size(); it++) {
@@ -990,7 +2586,7 @@ public:
 		return density;
 	}
 
-	double CoreComputeDensity(unsigned aID, vector<unsigned>& aApproximateNeighborhood) {
+	double CoreComputeDensity(unsigned aID, const vector<unsigned>& aApproximateNeighborhood) {
 		double density = 0;
 		//compute kernel pairs between i and all elements in aApproximateNeighborhood
 		for (unsigned j = 0; j < aApproximateNeighborhood.size(); j++) {
@@ -1010,11 +2606,21 @@ public:
 	double ComputeTrueDensity(unsigned aID) {
 		double density = 0;
 		if (mTrueDensityMap[aID] == -1) {
-			vector<pair<double, unsigned> > sim_list;
-			for (unsigned j = 0; j < mDataset.size(); j++) {
-				if (aID != j) {
-					double k_ij = Kernel(aID, j);
-					density += k_ij;
+			if (!mInvertedIndex.empty()) {
+				//only instances that share features contribute; sum them in id order as the exhaustive loop does
+				ScoreAccumulatorClass& score = mScoreAccumulatorList[omp_get_thread_num()];
+				SVector buffer;
+				AccumulateInvertedIndexScores(InstanceView(aID, buffer), 0, score);
+				vector<unsigned> touched(score.Touched());
+				sort(touched.begin(), touched.end());
+				for (unsigned j = 0; j < touched.size(); j++)
+					if (aID != touched[j]) density += score.Count(touched[j]);
+			} else {
+				for (unsigned j = 0; j < mDataset.size(); j++) {
+					if (aID != j) {
+						double k_ij = Kernel(aID, j);
+						density += k_ij;
+					}
 				}
 			}
 			density = density / (mDataset.size() - 1);
@@ -1090,22 +2696,21 @@ public:
 		//select non overlapping centers in decreasing order of density
 		sort(density_list.begin(), density_list.end(), mySort);
 		vector<unsigned> result;
-		set<unsigned> active_neighborhood;
+		vector<bool> active_neighborhood(mDataset.size(), false); //bitmap of the instances covered by the selected centers
 		{
 			ProgressBar progress_bar;
 			cout << "Computing minimally overlapping high density center list for up to "
 					<< aSampleSize << " centers." << endl; ////
 			for (unsigned i = 0; i < density_list.size() && result.size() < aSampleSize; i++) {
 				unsigned id = density_list[i].second;
-				vector<unsigned> neighborhood = ComputeApproximateNeighborhood(id);
-				set<unsigned> neighborhood_set;
-				neighborhood_set.insert(neighborhood.begin(), neighborhood.end());
-				set<unsigned> intersection;
-				set_intersection(active_neighborhood.begin(), active_neighborhood.end(),
-						neighborhood_set.begin(), neighborhood_set.end(),
-						inserter(intersection, intersection.begin()));
-				if (i == 0 || intersection.size() <= aMaxIntersectionSize) { //if the intersection between the neighborhood of the current center and the union of all active neighborhoods is less than a defined constant (eg. 0) then accept the new center in the active set
-					active_neighborhood.insert(neighborhood.begin(), neighborhood.end());
+				const vector<unsigned>& neighborhood = ComputeApproximateNeighborhood(id);
+				//count the instances already covered stopping as soon as the maximum intersection size is exceeded
+				unsigned intersection_size = 0;
+				for (unsigned t = 0; t < neighborhood.size() && intersection_size <= aMaxIntersectionSize; ++t)
+					if (active_neighborhood[neighborhood[t]]) intersection_size++;
+				if (i == 0 || intersection_size <= aMaxIntersectionSize) { //if the intersection between the neighborhood of the current center and the union of all active neighborhoods is less than a defined constant (eg. 0) then accept the new center in the active set
+					for (unsigned t = 0; t < neighborhood.size(); ++t)
+						active_neighborhood[neighborhood[t]] = true;
 					result.push_back(id);
 					progress_bar.Count();
 				}
@@ -1120,41 +2725,134 @@ public:
 		if (PARAM_OBJ.mMaxRefinement > 0 && PARAM_OBJ.mMaxIntersectionSize > 0) {
 			cout << "Attempt to improve over initial result (max num iterations "
 					<< PARAM_OBJ.mMaxRefinement << ")" << endl;
-			unsigned counter = 0;
-			for (unsigned j = 0; j < PARAM_OBJ.mMaxRefinement; j++) {
-				vector<unsigned> current_set(working_set);
-				double original_quality = CenterSetQuality(current_set);
-				unsigned rand_index_dest = randomUnsigned(selected_index_list.size());
-				unsigned dest_id = selected_index_list[rand_index_dest];
-				unsigned rand_index_src = randomUnsigned(current_set.size());
-				unsigned src_id = current_set[rand_index_src];
-				current_set[rand_index_src] = dest_id;
-				double current_quality = CenterSetQuality(current_set);
-				if (current_quality > original_quality) {
-					working_set = current_set;
-					counter++;
-					cout << "Replaced center with id=" << src_id << " with id=" << dest_id << endl;
+			if (PARAM_OBJ.mNumRefinementChains <= 1) {
+				GlobalRandomGeneratorClass random_generator;
+				unsigned counter = RefineCenterList(working_set, selected_index_list,
+						PARAM_OBJ.mMaxRefinement, random_generator, true);
+				if (counter > 0) {
+					cout << "Successfully executed " << counter << " replacements" << endl;
 				}
+			} else working_set = MultiStartRefineCenterList(result, selected_index_list);
+		}
+		return working_set;
+	}
+
+	///Runs -nrc independent refinement chains from the same initial center list, each with its own random
+	///generator seeded by -rs and the chain index, sharing the -mr iterations; returns the best final list
+	vector<unsigned> MultiStartRefineCenterList(const vector<unsigned>& aCenterList,
+												const vector<unsigned>& aCandidateList) {
+		unsigned num_chains = PARAM_OBJ.mNumRefinementChains;
+		vector<vector<unsigned> > chain_center_list(num_chains, aCenterList);
+		vector<unsigned> chain_counter_list(num_chains, 0);
+		cout << "Running " << num_chains << " refinement chains" << endl;
+		#pragma omp parallel for schedule(dynamic,1)
+		for (unsigned c = 0; c < num_chains; ++c) {
+			unsigned num_iterations = PARAM_OBJ.mMaxRefinement / num_chains
+					+ (c < PARAM_OBJ.mMaxRefinement % num_chains ? 1 : 0);
+			RandomGeneratorClass random_generator(PARAM_OBJ.mRandSeed, c + 1);
+			chain_counter_list[c] = RefineCenterList(chain_center_list[c], aCandidateList, num_iterations,
+					random_generator, false);
+		}
+		//NOTE: the best chain is chosen serially and ties go to the lowest chain index so that the result only depends on -rs and -nrc
+		unsigned best_chain = 0;
+		double best_quality = -HUGE_VAL;
+		for (unsigned c = 0; c < num_chains; ++c) {
+			double quality = CenterSetQuality(chain_center_list[c]);
+			cout << "Chain " << c << ": " << chain_counter_list[c] << " replacements, quality " << quality
+					<< endl;
+			if (quality > best_quality) {
+				best_quality = quality;
+				best_chain = c;
 			}
-			if (counter > 0) {
-				cout << "Successfully executed " << counter << " replacements" << endl;
+		}
+		cout << "Selected chain " << best_chain << " (initial quality " << CenterSetQuality(aCenterList)
+				<< ")" << endl;
+		return chain_center_list[best_chain];
+	}
+
+	///Attempts aNumIterations random swaps of a center with a candidate and keeps those that improve the
+	///quality of the center set; returns the number of replacements
+	template<class RandomGeneratorType>
+	unsigned RefineCenterList(	vector<unsigned>& ioCenterList,
+								const vector<unsigned>& aCandidateList,
+								unsigned aNumIterations,
+								RandomGeneratorType& aRandomGenerator,
+								bool aVerbose) {
+		//keep the number of centers covering each instance and the running totals of the quality measure so
+		//that a swap is evaluated looking only at the neighborhoods of the replaced and of the new center
+		vector<unsigned> coverage_list(mDataset.size(), 0);
+		unsigned union_size = 0;
+		unsigned size_sum = 0;
+		for (unsigned i = 0; i < ioCenterList.size(); ++i) {
+			const vector<unsigned>& neighborhood = ComputeApproximateNeighborhood(ioCenterList[i]);
+			union_size += AddCoverage(neighborhood, coverage_list);
+			size_sum += neighborhood.size();
+		}
+		double density_sum = CenterSetDensity(ioCenterList);
+		unsigned counter = 0;
+		for (unsigned j = 0; j < aNumIterations; j++) {
+			unsigned rand_index_dest = aRandomGenerator.Unsigned(aCandidateList.size());
+			unsigned dest_id = aCandidateList[rand_index_dest];
+			unsigned rand_index_src = aRandomGenerator.Unsigned(ioCenterList.size());
+			unsigned src_id = ioCenterList[rand_index_src];
+			if (src_id == dest_id) continue;
+			const vector<unsigned>& src_neighborhood = ComputeApproximateNeighborhood(src_id);
+			const vector<unsigned>& dest_neighborhood = ComputeApproximateNeighborhood(dest_id);
+			unsigned current_union_size = union_size - RemoveCoverage(src_neighborhood, coverage_list)
+					+ AddCoverage(dest_neighborhood, coverage_list);
+			unsigned current_size_sum = size_sum - src_neighborhood.size() + dest_neighborhood.size();
+			double current_density_sum = density_sum
+					+ (ComputeApproximateDensity(dest_id) - ComputeApproximateDensity(src_id));
+			double original_quality = density_sum * ((double) union_size / (double) size_sum);
+			double current_quality = current_density_sum
+					* ((double) current_union_size / (double) current_size_sum);
+			if (current_quality > original_quality) {
+				ioCenterList[rand_index_src] = dest_id;
+				union_size = current_union_size;
+				size_sum = current_size_sum;
+				density_sum = CenterSetDensity(ioCenterList); //NOTE: resum to avoid the drift of the running total
+				counter++;
+				if (aVerbose) cout << "Replaced center with id=" << src_id << " with id=" << dest_id << endl;
+			} else { //restore the coverage of the original set
+				RemoveCoverage(dest_neighborhood, coverage_list);
+				AddCoverage(src_neighborhood, coverage_list);
 			}
 		}
-		return working_set;
+		return counter;
 	}
 
-	double CenterSetQuality(vector<unsigned> aSet) {
-		//compute sum of approximate densities
+	///Increments the coverage count of the instances in the neighborhood and returns how many of them were not covered before
+	static unsigned AddCoverage(const vector<unsigned>& aNeighborhood, vector<unsigned>& oCoverageList) {
+		unsigned num_newly_covered = 0;
+		for (unsigned i = 0; i < aNeighborhood.size(); ++i)
+			if (oCoverageList[aNeighborhood[i]]++ == 0) num_newly_covered++;
+		return num_newly_covered;
+	}
+
+	///Decrements the coverage count of the instances in the neighborhood and returns how many of them are no longer covered
+	static unsigned RemoveCoverage(const vector<unsigned>& aNeighborhood, vector<unsigned>& oCoverageList) {
+		unsigned num_uncovered = 0;
+		for (unsigned i = 0; i < aNeighborhood.size(); ++i)
+			if (--oCoverageList[aNeighborhood[i]] == 0) num_uncovered++;
+		return num_uncovered;
+	}
+
+	double CenterSetDensity(const vector<unsigned>& aSet) {
 		double density = 0;
-		for (unsigned i = 0; i < aSet.size(); ++i) {
+		for (unsigned i = 0; i < aSet.size(); ++i)
 			density += ComputeApproximateDensity(aSet[i]);
-		}
+		return density;
+	}
+
+	double CenterSetQuality(const vector<unsigned>& aSet) {
+		//compute sum of approximate densities
+		double density = CenterSetDensity(aSet);
 		//compute scaling factor as the ration of the size of the union of the neighb over the sum of the sizes of the neigh
 
 		unsigned size_sum = 0;
 		set<unsigned> union_set;
 		for (unsigned i = 0; i < aSet.size(); ++i) {
-			vector<unsigned> neighborhood = ComputeApproximateNeighborhood(aSet[i]);
+			const vector<unsigned>& neighborhood = ComputeApproximateNeighborhood(aSet[i]);
 			union_set.insert(neighborhood.begin(), neighborhood.end());
 			size_sum += neighborhood.size();
 		}
@@ -1197,9 +2895,13 @@ public:
 		return neighborhood;
 	}
 
-	void OutputApproximateCluster() {
-//TODO finish the approximate cluster
-		//output cluster but replace all calls to true_similarity with shared neighb similarity over approximate neighb
+	///Clusters using only the min-hash signatures: the feature vectors are discarded at input time and the
+	///similarity of two instances is estimated by SketchSimilarity, so density estimation, center selection
+	///and the neighborhood ranking of OutputCluster run on the bins and signatures alone
+	void OutputApproximateCluster(ostream& out, ostream& out2) {
+		cout << "Sketch only clustering of " << mDataset.size() << " instances using " << NumBins()
+				<< " signature values per instance" << endl;
+		OutputCluster(out, out2);
 	}
 
 	void OutputCluster(ostream& out, ostream& out2 ) {
@@ -1251,6 +2953,8 @@ public:
 	}
 
 	void OutputClusterVerbose(ostream& out, vector<unsigned> aDensityCenterList) {
+		//NOTE: with sketches (-oac) no instance is stored, densities are estimated from the sketches via Kernel
+		if (mInvertedIndex.empty() && mSketchList.empty()) ComputeInvertedIndex();
 		vector<double> density_list;
 		{
 			ProgressBar progress_bar;
@@ -1286,6 +2990,7 @@ public:
 	}
 
 	void OutputAccuracy(ostream& out) {
+		if (mInvertedIndex.empty() && mSketchList.empty()) ComputeInvertedIndex();
 		cout << "Compute neighbourhood accuracy" << endl; ////
 		ProgressBar progress_bar;
 		double cum = 0;
@@ -1293,7 +2998,7 @@ public:
 				(unsigned) mDataset.size());
 		for (unsigned u = 0; u < mDataset.size(); ++u) {
 			progress_bar.Count();
-			vector<unsigned> approximate_neighborhood = ComputeApproximateNeighborhood(u);
+			const vector<unsigned>& approximate_neighborhood = ComputeApproximateNeighborhood(u);
 			set<unsigned> approximate_neighborhood_set;
 			approximate_neighborhood_set.insert(approximate_neighborhood.begin(),
 					approximate_neighborhood.end());
@@ -1311,6 +3016,258 @@ public:
 		cout << endl << "Accuracy: " << cum / mDataset.size() << endl;
 	}
 
+	///Loads the approximate kNN graph from PARAM_OBJ.mKNNGraphFileName if the file exists, otherwise builds it
+	///and saves it there
+	void PrepareKNNGraph() {
+		ifstream fin(PARAM_OBJ.mKNNGraphFileName.c_str(), ios::binary);
+		if (fin) {
+			cout << "Reading approximate k-nearest neighbour graph from " << PARAM_OBJ.mKNNGraphFileName
+					<< endl;
+			LoadKNNGraph(fin);
+			return;
+		}
+		ComputeKNNGraph();
+		cout << "Writing approximate k-nearest neighbour graph to " << PARAM_OBJ.mKNNGraphFileName << endl;
+		ofstream ofs(PARAM_OBJ.mKNNGraphFileName.c_str(), ios::binary);
+		if (!ofs) throw range_error("Cannot open file:" + PARAM_OBJ.mKNNGraphFileName);
+		SaveKNNGraph(ofs);
+	}
+
+	///The header records the data (through its checksum) and all the parameters the graph depends on, i.e. those
+	///of the bin data structure that provides the initial candidates and those of the neighbour descent
+	vector<unsigned> KNNGraphHeader() const {
+		vector<unsigned> header;
+		header.push_back(KNN_GRAPH_FORMAT_VERSION);
+		header.push_back(mDataset.size());
+		header.push_back(PARAM_OBJ.mNumNearestNeighbors);
+		header.push_back(NumBins());
+		header.push_back(PARAM_OBJ.mNumHashFunctions);
+		header.push_back(PARAM_OBJ.mHashFactor);
+		header.push_back(PARAM_OBJ.mNumBands);
+		header.push_back(PARAM_OBJ.mNumRowsPerBand);
+		header.push_back(PARAM_OBJ.mWeightedMinHash);
+		header.push_back(PARAM_OBJ.mRandSeed);
+		header.push_back((unsigned) (PARAM_OBJ.mEccessNeighbourSizeFactor * PARAM_OBJ.mNumNearestNeighbors));
+		header.push_back(PARAM_OBJ.mNNDescentMaxIterations);
+		unsigned long long checksum = DatasetChecksum();
+		header.push_back((unsigned) checksum);
+		header.push_back((unsigned) (checksum >> 32));
+		return header;
+	}
+
+	///Hash of the ids and values of all instances (or of their sketches with -oac), in instance order
+	unsigned long long DatasetChecksum() const {
+		unsigned long long checksum = 0;
+		for (unsigned i = 0; i < mDataset.size(); ++i) {
+			SVector buffer;
+			for (const SVector::Pair* p = InstanceView(i, buffer); p && p->i >= 0; p++) {
+				unsigned value_bits;
+				memcpy(&value_bits, &p->v, sizeof(unsigned));
+				checksum = HashMix(p->i ^ (unsigned) checksum, value_bits, (unsigned) (checksum >> 32));
+			}
+			if (i < mSketchList.size())
+				for (unsigned k = 0; k < mSketchList[i].size(); ++k)
+					checksum = HashMix(mSketchList[i][k] ^ (unsigned) checksum, k, (unsigned) (checksum >> 32));
+			checksum = HashMix(i ^ (unsigned) checksum, 0, (unsigned) (checksum >> 32)); //instance boundary
+		}
+		return checksum;
+	}
+
+	///Binary format: header size and header, then for each instance the number of neighbors, their ids and
+	///their similarities as floats
+	void SaveKNNGraph(ostream& out) const {
+		vector<unsigned> header = KNNGraphHeader();
+		unsigned header_size = header.size();
+		out.write((const char*) &header_size, sizeof(unsigned));
+		out.write((const char*) &header[0], sizeof(unsigned) * header_size);
+		for (unsigned i = 0; i < mKNNGraph.size(); ++i) {
+			unsigned size = mKNNGraph[i].size();
+			out.write((const char*) &size, sizeof(unsigned));
+			if (size == 0) continue;
+			out.write((const char*) &mKNNGraph[i][0], sizeof(unsigned) * size);
+			out.write((const char*) &mKNNGraphValueList[i][0], sizeof(float) * size);
+		}
+		if (!out.good()) throw range_error("ERROR:Cannot write k-nearest neighbour graph");
+	}
+
+	void LoadKNNGraph(istream& in) {
+		vector<unsigned> header = KNNGraphHeader();
+		unsigned header_size = 0;
+		in.read((char*) &header_size, sizeof(unsigned));
+		vector<unsigned> file_header(header_size);
+		if (header_size > 0) in.read((char*) &file_header[0], sizeof(unsigned) * header_size);
+		if (!in.good() || file_header != header)
+			throw range_error(
+					"ERROR:k-nearest neighbour graph in file <" + PARAM_OBJ.mKNNGraphFileName
+							+ "> was built with different data or parameters");
+		mKNNGraph.assign(mDataset.size(), vector<unsigned>());
+		mKNNGraphValueList.assign(mDataset.size(), vector<float>());
+		for (unsigned i = 0; i < mDataset.size() && in.good(); ++i) {
+			unsigned size = 0;
+			in.read((char*) &size, sizeof(unsigned));
+			if (size == 0) continue;
+			mKNNGraph[i].resize(size);
+			mKNNGraphValueList[i].resize(size);
+			in.read((char*) &mKNNGraph[i][0], sizeof(unsigned) * size);
+			in.read((char*) &mKNNGraphValueList[i][0], sizeof(float) * size);
+		}
+		if (!in.good())
+			throw range_error("ERROR:Truncated k-nearest neighbour graph in file <" + PARAM_OBJ.mKNNGraphFileName + ">");
+	}
+
+	///Inserts a neighbor in a list kept sorted by decreasing value (ties by increasing id) and bounded to aSize
+	///entries; returns true if the list has changed
+	static bool InsertGraphNeighbor(vector<GraphNeighborClass>& ioList, unsigned aSize, unsigned aID, double aValue) {
+		if (ioList.size() >= aSize
+				&& !(aValue > ioList.back().mValue || (aValue == ioList.back().mValue && aID < ioList.back().mID)))
+			return false;
+		unsigned pos = ioList.size();
+		for (unsigned t = 0; t < ioList.size(); ++t) {
+			if (ioList[t].mID == aID) return false;
+			if (pos == ioList.size()
+					&& (aValue > ioList[t].mValue || (aValue == ioList[t].mValue && aID < ioList[t].mID)))
+				pos = t;
+		}
+		GraphNeighborClass neighbor = { aValue, aID, true };
+		ioList.insert(ioList.begin() + pos, neighbor);
+		if (ioList.size() > aSize) ioList.pop_back();
+		return true;
+	}
+
+	///Adds an element to a list that keeps a uniform sample of at most aSize of the aNumSeen elements offered
+	static void ReservoirAdd(	vector<unsigned>& ioSample,
+								unsigned& ioNumSeen,
+								unsigned aID,
+								unsigned aSize,
+								RandomGeneratorClass& aRandomGenerator) {
+		ioNumSeen++;
+		if (ioSample.size() < aSize) ioSample.push_back(aID);
+		else {
+			unsigned j = aRandomGenerator.Unsigned(ioNumSeen);
+			if (j < aSize) ioSample[j] = aID;
+		}
+	}
+
+	///Builds the approximate kNN graph: each neighbor list is seeded with the candidates that share the most
+	///bins and then refined by neighbour descent, i.e. by comparing the pairs of neighbors (and reverse
+	///neighbors) of each instance, until few lists change. Lists are updated serially after each block of
+	///local joins so that the graph depends only on -rs and not on the number of threads.
+	void ComputeKNNGraph() {
+		const unsigned data_size = mDataset.size();
+		const unsigned size = max(1u, PARAM_OBJ.mNumNearestNeighbors - 1); //neighbors other than the instance itself
+		const unsigned num_candidates = PARAM_OBJ.mEccessNeighbourSizeFactor * PARAM_OBJ.mNumNearestNeighbors;
+		PrepareBinDataStructure();
+		cout << "Computing approximate " << size << "-nearest neighbour graph for " << data_size
+				<< " instances by neighbour descent (max num iterations " << PARAM_OBJ.mNNDescentMaxIterations
+				<< ")" << endl;
+		vector<vector<GraphNeighborClass> > graph(data_size);
+		double num_evaluations = 0;
+		{
+			ProgressBar progress_bar;
+			#pragma omp parallel for schedule(dynamic,10) reduction(+:num_evaluations)
+			for (unsigned i = 0; i < data_size; ++i) {
+				vector<unsigned> candidate_list = ComputeApproximateNeighborhood(ComputeHashSignature(i),
+						num_candidates);
+				for (unsigned t = 0; t < candidate_list.size(); ++t)
+					if (candidate_list[t] != i) {
+						InsertGraphNeighbor(graph[i], size, candidate_list[t], Similarity(i, candidate_list[t]));
+						num_evaluations++;
+					}
+				//pad lists with too few candidates with random instances
+				RandomGeneratorClass random_generator(PARAM_OBJ.mRandSeed, i);
+				for (unsigned t = 0; t < 4 * size && graph[i].size() < size && data_size > 1; ++t) {
+					unsigned j = random_generator.Unsigned(data_size);
+					if (j != i) {
+						InsertGraphNeighbor(graph[i], size, j, Similarity(i, j));
+						num_evaluations++;
+					}
+				}
+				#pragma omp critical
+				progress_bar.Count();
+			}
+		}
+		for (unsigned iteration = 0; iteration < PARAM_OBJ.mNNDescentMaxIterations; ++iteration) {
+			//split neighbors in new and old ones and add a sample of the reverse neighbors of each kind
+			vector<vector<unsigned> > new_list(data_size), old_list(data_size);
+			for (unsigned i = 0; i < data_size; ++i)
+				for (unsigned t = 0; t < graph[i].size(); ++t) {
+					if (graph[i][t].mIsNew) new_list[i].push_back(graph[i][t].mID);
+					else old_list[i].push_back(graph[i][t].mID);
+					graph[i][t].mIsNew = false;
+				}
+			vector<vector<unsigned> > reverse_new_list(data_size), reverse_old_list(data_size);
+			vector<unsigned> num_seen_new(data_size, 0), num_seen_old(data_size, 0);
+			RandomGeneratorClass random_generator(PARAM_OBJ.mRandSeed, data_size + iteration);
+			for (unsigned i = 0; i < data_size; ++i) {
+				for (unsigned t = 0; t < new_list[i].size(); ++t)
+					ReservoirAdd(reverse_new_list[new_list[i][t]], num_seen_new[new_list[i][t]], i, size,
+							random_generator);
+				for (unsigned t = 0; t < old_list[i].size(); ++t)
+					ReservoirAdd(reverse_old_list[old_list[i][t]], num_seen_old[old_list[i][t]], i, size,
+							random_generator);
+			}
+			for (unsigned i = 0; i < data_size; ++i) {
+				new_list[i].insert(new_list[i].end(), reverse_new_list[i].begin(), reverse_new_list[i].end());
+				sort(new_list[i].begin(), new_list[i].end());
+				new_list[i].erase(unique(new_list[i].begin(), new_list[i].end()), new_list[i].end());
+				old_list[i].insert(old_list[i].end(), reverse_old_list[i].begin(), reverse_old_list[i].end());
+				sort(old_list[i].begin(), old_list[i].end());
+				old_list[i].erase(unique(old_list[i].begin(), old_list[i].end()), old_list[i].end());
+			}
+			//local joins: pairs of new neighbors and pairs of a new and an old neighbor of the same instance
+			unsigned num_updates = 0;
+			const unsigned BLOCK_SIZE = 1024;
+			vector<vector<pair<double, pair<unsigned, unsigned> > > > update_list(BLOCK_SIZE);
+			for (unsigned block_begin = 0; block_begin < data_size; block_begin += BLOCK_SIZE) {
+				unsigned block_end = min(data_size, block_begin + BLOCK_SIZE);
+				#pragma omp parallel for schedule(dynamic,10) reduction(+:num_evaluations)
+				for (unsigned i = block_begin; i < block_end; ++i) {
+					vector<pair<double, pair<unsigned, unsigned> > >& updates = update_list[i - block_begin];
+					updates.clear();
+					const vector<unsigned>& new_neighbors = new_list[i];
+					const vector<unsigned>& old_neighbors = old_list[i];
+					for (unsigned a = 0; a < new_neighbors.size(); ++a) {
+						unsigned u = new_neighbors[a];
+						for (unsigned b = a + 1; b < new_neighbors.size() + old_neighbors.size(); ++b) {
+							unsigned v = b < new_neighbors.size() ? new_neighbors[b] : old_neighbors[b - new_neighbors.size()];
+							if (u == v) continue;
+							double value = Similarity(u, v);
+							num_evaluations++;
+							//NOTE: the lists are not modified during the block so they can be read to discard hopeless pairs
+							if ((graph[u].size() < size || value >= graph[u].back().mValue)
+									|| (graph[v].size() < size || value >= graph[v].back().mValue))
+								updates.push_back(make_pair(value, make_pair(u, v)));
+						}
+					}
+				}
+				for (unsigned i = block_begin; i < block_end; ++i) {
+					const vector<pair<double, pair<unsigned, unsigned> > >& updates = update_list[i - block_begin];
+					for (unsigned t = 0; t < updates.size(); ++t) {
+						unsigned u = updates[t].second.first;
+						unsigned v = updates[t].second.second;
+						if (InsertGraphNeighbor(graph[u], size, v, updates[t].first)) num_updates++;
+						if (InsertGraphNeighbor(graph[v], size, u, updates[t].first)) num_updates++;
+					}
+				}
+			}
+			cout << "Iteration " << iteration + 1 << ": " << num_updates << " neighbor list updates" << endl;
+			if (num_updates <= NN_DESCENT_MIN_UPDATE_RATE * data_size * size) break;
+		}
+		double num_pairs = (double) data_size * (data_size - 1) / 2;
+		cout << "Similarity evaluations: " << num_evaluations << " ("
+				<< (num_pairs > 0 ? num_evaluations / num_pairs : 0) << " of all pairs)" << endl;
+		mKNNGraph.assign(data_size, vector<unsigned>());
+		mKNNGraphValueList.assign(data_size, vector<float>());
+		for (unsigned i = 0; i < data_size; ++i) {
+			mKNNGraph[i].push_back(i);
+			mKNNGraphValueList[i].push_back(Similarity(i, i));
+			for (unsigned t = 0; t < graph[i].size() && mKNNGraph[i].size() < PARAM_OBJ.mNumNearestNeighbors; ++t) {
+				mKNNGraph[i].push_back(graph[i][t].mID);
+				mKNNGraphValueList[i].push_back(graph[i][t].mValue);
+			}
+		}
+	}
+
 	void OutputApproximateKNN(ostream& out, ostream& out2) {
 		vector<int> id_list;
 		if (mGreyList.size() > 0) {
@@ -1320,40 +3277,41 @@ public:
 			for (unsigned i = 0; i < mDataset.size(); ++i)
 				id_list.push_back(i);
 		}
+		cout << "using num threads = "<< omp_get_max_threads()<< endl;
 		cout << "Compute approximate nearest neighbours for " << id_list.size() << " elements."
 				<< endl; ////
 		ProgressBar progress_bar;
-		for (unsigned u = 0; u < id_list.size(); ++u) {
-			vector<unsigned> approximate_neighborhood = ComputeApproximateNeighborhood(id_list[u]);
-
-		/*	if ( !approximate_neighborhood.empty() && approximate_neighborhood[0] != id_list[u]){
-
-			  vector<unsigned>::iterator it;
-			  it = find(approximate_neighborhood.begin(), approximate_neighborhood.end(), id_list[u]);
-
-			  if (it != approximate_neighborhood.end() ){
-			    iter_swap(approximate_neighborhood.begin(),it);
-			  } else{
-			    approximate_neighborhood.clear();
-			    cout << "Approx neighbourhood does not conain itself " << (id_list[u]+1) << "Size="<< approximate_neighborhood.size() <<endl;
-			  }
-			} */
-			unsigned uID= id_list[u];
-			for (unsigned t = 0; t < approximate_neighborhood.size(); ++t) {
-				out << approximate_neighborhood[t] + 1 << " "; //NOTE: numbering starts from 1
-				unsigned tID = approximate_neighborhood[t];
-				double k_ut = Kernel(uID, tID);
-				out2 <<  (tID+1) << ":" << k_ut << " "; //NOTE: numbering starts from 1
-
+		//instances are processed in parallel one block at a time; the lines of each block are buffered
+		//and written in id order so that the output does not depend on the number of threads
+		const unsigned BLOCK_SIZE = 1024;
+		vector<string> line_list(BLOCK_SIZE), sim_line_list(BLOCK_SIZE);
+		for (unsigned block_begin = 0; block_begin < id_list.size(); block_begin += BLOCK_SIZE) {
+			unsigned block_end = min((unsigned) id_list.size(), block_begin + BLOCK_SIZE);
+			#pragma omp parallel for schedule(dynamic,10)
+			for (unsigned u = block_begin; u < block_end; ++u) {
+				unsigned uID = id_list[u];
+				const vector<unsigned>& approximate_neighborhood = ComputeApproximateNeighborhood(uID);
+				stringstream ss, ss2;
+				for (unsigned t = 0; t < approximate_neighborhood.size(); ++t) {
+					ss << approximate_neighborhood[t] + 1 << " "; //NOTE: numbering starts from 1
+					unsigned tID = approximate_neighborhood[t];
+					double k_ut = Kernel(uID, tID);
+					ss2 << (tID + 1) << ":" << k_ut << " "; //NOTE: numbering starts from 1
+				}
+				line_list[u - block_begin] = ss.str();
+				sim_line_list[u - block_begin] = ss2.str();
+				#pragma omp critical
+				progress_bar.Count();
+			}
+			for (unsigned u = block_begin; u < block_end; ++u) {
+				out << line_list[u - block_begin] << endl;
+				out2 << sim_line_list[u - block_begin] << endl;
 			}
-			out << endl;
-			out2 << endl;
-			progress_bar.Count();
 		}
 	}
 
 	void OutputTrueKNN(ostream& out, ostream& out2) {
-		vector<int> id_list;
+		vector<unsigned> id_list;
 		if (mGreyList.size() > 0) {
 			for (unsigned i = 0; i < mGreyList.size(); ++i)
 				id_list.push_back(mGreyList[i] - 1);
@@ -1363,27 +3321,352 @@ public:
 		}
 		unsigned effective_neighbourhood_size = min(PARAM_OBJ.mNumNearestNeighbors,
 				(unsigned) mDataset.size());
+		cout << "using num threads = "<< omp_get_max_threads()<< endl;
 		cout << "Compute true " << effective_neighbourhood_size << "-nearest neighbours for "
 				<< id_list.size() << " elements." << endl; ////
-		ProgressBar progress_bar;
-		for (unsigned i = 0; i < id_list.size(); ++i) {
-			unsigned u = id_list[i];
-			vector<pair<double, unsigned> > sim_list;
-			//compute kernel pairs between aID and all elements
-			for (unsigned v = 0; v < mDataset.size(); v++) {
-				double k_uv = Kernel(u, v);
-				sim_list.push_back(make_pair(-k_uv, v)); //note: use -k to sort in decreasing order
-			}
-			//sort and take truly most similar
-			sort(sim_list.begin(), sim_list.end());
-			for (unsigned k = 0; k < effective_neighbourhood_size; ++k) {
+		vector<vector<pair<double, unsigned> > > knn_list;
+		//NOTE: the symmetric all pairs scan cannot prune, hence with bounds each instance is searched on its own
+		if (mGreyList.size() > 0 || IsBoundPruningActive()) ComputeTrueKNN(id_list, effective_neighbourhood_size, knn_list);
+		else ComputeAllTrueKNN(effective_neighbourhood_size, knn_list);
+		for (unsigned i = 0; i < knn_list.size(); ++i) {
+			vector<pair<double, unsigned> >& sim_list = knn_list[i];
+			for (unsigned k = 0; k < sim_list.size(); ++k) {
 				out << sim_list[k].second + 1 << " "; //NOTE: numbering starts from 1
 				out2 <<  sim_list[k].second + 1 << ":" << -sim_list[k].first << " "; //NOTE: numbering starts from 0
 			}
 			out << endl;
 			out2 << endl;
+		}
+	}
+
+	///Finds all the pairs of instances with kernel value at least aThreshold with the prefix filtering of AllPairs
+	///(Bayardo et al., 2007). Features are ranked by decreasing frequency and each instance is split into a prefix of
+	///frequent features and a suffix, which starts as soon as the prefix alone could reach aThreshold with some
+	///instance. The bound on the prefix is the smaller between the sum of its values times the feature maximum
+	///values and its norm times the largest instance norm (as in L2AP). Only suffixes are indexed: two instances
+	///above the threshold share an indexed feature, so candidates come from the index alone and those whose
+	///partial score plus prefix bound reaches the threshold are verified with the exact kernel. The bounds
+	///require non negative values; otherwise all features are indexed. oNeighborList lists for each instance
+	///the ids (in increasing order) of the instances above the threshold.
+	void ComputeAllPairs(double aThreshold, vector<vector<unsigned> >& oNeighborList, vector<vector<float> >& oValueList) {
+		unsigned data_size = mDataset.size();
+		cout << "Compute all pairs with kernel >= " << aThreshold << " for " << data_size << " instances" << endl;
+		//feature statistics and largest norm
+		umap_uint_feature_statistics feature_statistics;
+		double max_norm = 0;
+		bool is_non_negative = true;
+		for (unsigned i = 0; i < data_size; ++i) {
+			SVector buffer;
+			SVectorView x = InstanceView(i, buffer);
+			for (const SVector::Pair* p = x; p && p->i >= 0; p++) {
+				FeatureStatisticsClass& statistics = feature_statistics[p->i];
+				statistics.mCount++;
+				statistics.mSum += p->v;
+				statistics.mMaxValue = max(statistics.mMaxValue, (double) p->v);
+				if (p->v < 0) is_non_negative = false;
+			}
+			max_norm = max(max_norm, sqrt(dot(x, x)));
+		}
+		//rank features by decreasing frequency (ties by increasing id)
+		vector<pair<int, unsigned> > feature_order;
+		for (umap_uint_feature_statistics::const_iterator it = feature_statistics.begin(); it != feature_statistics.end(); ++it)
+			feature_order.push_back(make_pair(-(int) it->second.mCount, it->first));
+		sort(feature_order.begin(), feature_order.end());
+		std::tr1::unordered_map<unsigned, unsigned> feature_rank;
+		vector<double> max_value_list(feature_order.size());
+		for (unsigned r = 0; r < feature_order.size(); ++r) {
+			feature_rank[feature_order[r].second] = r;
+			max_value_list[r] = feature_statistics[feature_order[r].second].mMaxValue;
+		}
+		//split the instances and index their suffixes; posting lists are filled in increasing instance id order
+		vector<vector<pair<unsigned, float> > > posting_list_list(feature_order.size());
+		vector<double> prefix_bound_list(data_size, 0);
+		double num_postings = 0;
+		for (unsigned i = 0; i < data_size; ++i) {
+			SVector buffer;
+			SVectorView x = InstanceView(i, buffer);
+			vector<pair<unsigned, float> > ranked_list;
+			for (const SVector::Pair* p = x; p && p->i >= 0; p++)
+				ranked_list.push_back(make_pair(feature_rank[p->i], p->v));
+			sort(ranked_list.begin(), ranked_list.end());
+			double max_value_bound = 0;
+			double squared_norm = 0;
+			unsigned k = 0;
+			for (; is_non_negative && k < ranked_list.size(); ++k) {
+				double value = ranked_list[k].second;
+				double next_bound = min(max_value_bound + value * max_value_list[ranked_list[k].first],
+						max_norm * sqrt(squared_norm + value * value));
+				if (next_bound >= aThreshold) break;
+				prefix_bound_list[i] = next_bound;
+				max_value_bound += value * max_value_list[ranked_list[k].first];
+				squared_norm += value * value;
+			}
+			for (; k < ranked_list.size(); ++k) {
+				posting_list_list[ranked_list[k].first].push_back(make_pair(i, ranked_list[k].second));
+				num_postings++;
+			}
+		}
+		//each instance is matched against the indexed suffixes of the instances with smaller id
+		vector<vector<pair<unsigned, float> > > match_list(data_size);
+		double num_candidates = 0;
+		double num_verified = 0;
+		//NOTE: partial scores are summed in a different order than in dot(), hence the small tolerance
+		const double tolerance = 1e-6;
+		{
+			ProgressBar progress_bar;
+			#pragma omp parallel for schedule(dynamic,10) reduction(+:num_candidates,num_verified)
+			for (unsigned i = 0; i < data_size; ++i) {
+				ScoreAccumulatorClass& score = mScoreAccumulatorList[omp_get_thread_num()];
+				score.Begin(data_size);
+				SVector buffer;
+				for (const SVector::Pair* p = InstanceView(i, buffer); p && p->i >= 0; p++) {
+					const vector<pair<unsigned, float> >& posting_list = posting_list_list[feature_rank.find(p->i)->second];
+					for (unsigned t = 0; t < posting_list.size() && posting_list[t].first < i; ++t)
+						score.Add(posting_list[t].first, (double) p->v * (double) posting_list[t].second);
+				}
+				const vector<unsigned>& touched = score.Touched();
+				num_candidates += touched.size();
+				for (unsigned t = 0; t < touched.size(); ++t) {
+					unsigned j = touched[t];
+					if (is_non_negative && score.Count(j) + prefix_bound_list[j] < aThreshold - tolerance) continue;
+					num_verified++;
+					double value = Similarity(j, i);
+					if (value >= aThreshold) match_list[i].push_back(make_pair(j, (float) value));
+				}
+				#pragma omp critical
+				progress_bar.Count();
+			}
+		}
+		//symmetric neighbor lists
+		//NOTE: they come out sorted: the entries j<i of list i are appended, in order, while visiting i, and the
+		//entries j>i later on while visiting each j in increasing order
+		oNeighborList.assign(data_size, vector<unsigned>());
+		oValueList.assign(data_size, vector<float>());
+		double num_pairs = 0;
+		for (unsigned i = 0; i < data_size; ++i) {
+			sort(match_list[i].begin(), match_list[i].end());
+			for (unsigned t = 0; t < match_list[i].size(); ++t) {
+				unsigned j = match_list[i][t].first;
+				oNeighborList[i].push_back(j);
+				oValueList[i].push_back(match_list[i][t].second);
+				oNeighborList[j].push_back(i);
+				oValueList[j].push_back(match_list[i][t].second);
+				num_pairs++;
+			}
+		}
+		cout << "All pairs: " << num_postings << " indexed postings; " << num_candidates << " candidate pairs, "
+				<< num_verified << " verified, " << num_pairs << " above threshold" << endl;
+	}
+
+	///Binary format: header size and header, then for each instance the number of neighbors, their ids and their
+	///kernel values as floats
+	void OutputAllPairs(ostream& out) {
+		vector<vector<unsigned> > neighbor_list;
+		vector<vector<float> > value_list;
+		ComputeAllPairs(PARAM_OBJ.mAllPairsThreshold, neighbor_list, value_list);
+		vector<unsigned> header;
+		header.push_back(ALL_PAIRS_FORMAT_VERSION);
+		header.push_back(neighbor_list.size());
+		unsigned header_size = header.size();
+		out.write((const char*) &header_size, sizeof(unsigned));
+		out.write((const char*) &header[0], sizeof(unsigned) * header_size);
+		for (unsigned i = 0; i < neighbor_list.size(); ++i) {
+			unsigned size = neighbor_list[i].size();
+			out.write((const char*) &size, sizeof(unsigned));
+			if (size == 0) continue;
+			out.write((const char*) &neighbor_list[i][0], sizeof(unsigned) * size);
+			out.write((const char*) &value_list[i][0], sizeof(float) * size);
+		}
+		if (!out.good()) throw range_error("ERROR:Cannot write all pairs similarity graph");
+	}
+
+	///Prepares the upper bounds used to prune exact top-k searches (-kbp): the norm of each instance and, for each
+	///block of BOUND_BLOCK_SIZE consecutive instances, the largest norm and the vector of the maximum value of each
+	///feature (block-max). The block-max bound, i.e. the dot product with the block-max vector, is only valid for
+	///non negative values; the norm bound (Cauchy-Schwarz) always is.
+	void PrepareBoundPruning() {
+		if (!mSketchList.empty()) return;
+		unsigned data_size = mDataset.size();
+		unsigned num_blocks = (data_size + BOUND_BLOCK_SIZE - 1) / BOUND_BLOCK_SIZE;
+		cout << "Computing norm and block-max bounds for " << num_blocks << " blocks of " << BOUND_BLOCK_SIZE
+				<< " instances" << endl;
+		mNormList.resize(data_size);
+		mBlockNormList.assign(num_blocks, 0);
+		mBlockMaxMatrix.Clear();
+		mBlockMaxIsValid = true;
+		for (unsigned b = 0; b < num_blocks; ++b) {
+			vector<pair<int, float> > pair_list;
+			for (unsigned i = b * BOUND_BLOCK_SIZE; i < min(data_size, (b + 1) * BOUND_BLOCK_SIZE); ++i) {
+				SVector buffer;
+				SVectorView x = InstanceView(i, buffer);
+				mNormList[i] = sqrt(dot(x, x));
+				mBlockNormList[b] = max(mBlockNormList[b], mNormList[i]);
+				for (const SVector::Pair* p = x; p && p->i >= 0; p++) {
+					if (p->v < 0) mBlockMaxIsValid = false;
+					pair_list.push_back(make_pair(p->i, p->v));
+				}
+			}
+			sort(pair_list.begin(), pair_list.end());
+			SVector block_max;
+			for (unsigned k = 0; k < pair_list.size(); ++k)
+				if (k + 1 == pair_list.size() || pair_list[k + 1].first != pair_list[k].first)
+					block_max.set(pair_list[k].first, pair_list[k].second); //NOTE: the largest value of a feature comes last
+			mBlockMaxMatrix.AddRow(block_max);
+		}
+		mBlockMaxMatrix.Trim();
+	}
+
+	///Upper bound of the kernel value between aX, of norm aNorm, and any instance of block aBlock
+	inline double BlockBound(const SVectorView& aX, double aNorm, unsigned aBlock) const {
+		double bound = aNorm * mBlockNormList[aBlock];
+		if (mBlockMaxIsValid) bound = min(bound, dot(aX, mBlockMaxMatrix.Row(aBlock)));
+		return bound;
+	}
+
+	///Exact search of the aK instances most similar to instance aID, kept in oHeap as in PushTopK
+	void BoundedTopK(unsigned aID, unsigned aK, vector<pair<double, unsigned> >& oHeap) {
+		SVector buffer;
+		BoundedTopK(InstanceView(aID, buffer), mNormList[aID], aID, aK, oHeap);
+	}
+
+	///Exact search of the aK instances most similar to a vector that is not part of the dataset
+	void BoundedTopK(const SVectorView& aX, unsigned aK, vector<pair<double, unsigned> >& oHeap) {
+		BoundedTopK(aX, sqrt(dot(aX, aX)), -1, aK, oHeap);
+	}
+
+	///Blocks are visited in decreasing order of their bound and the search stops as soon as a bound cannot beat
+	///the current aK-th best value; within a block instances whose norm bound cannot beat it are skipped. As
+	///PushTopK keeps the aK smallest (-kernel, id) pairs whatever the order they are offered in, the result is the
+	///same as for the exhaustive search. aID is the id of aX in the dataset, or -1 for an external query.
+	void BoundedTopK(const SVectorView& aX, double aNorm, int aID, unsigned aK, vector<pair<double, unsigned> >& oHeap) {
+		//NOTE: bounds are inflated by a relative tolerance to absorb rounding in the norms
+		const double tolerance = 1e-9;
+		unsigned data_size = mDataset.size();
+		vector<pair<double, unsigned> > block_list(mBlockNormList.size());
+		for (unsigned b = 0; b < block_list.size(); ++b)
+			block_list[b] = make_pair(-BlockBound(aX, aNorm, b) * (1 + tolerance), b);
+		sort(block_list.begin(), block_list.end());
+		double num_evaluated = 0;
+		double num_skipped = 0;
+		oHeap.clear();
+		for (unsigned t = 0; t < block_list.size(); ++t) {
+			unsigned b = block_list[t].second;
+			unsigned block_begin = b * BOUND_BLOCK_SIZE;
+			unsigned block_end = min(data_size, block_begin + BOUND_BLOCK_SIZE);
+			if (oHeap.size() == aK && aK > 0 && -block_list[t].first < -oHeap.front().first) {
+				for (unsigned r = t; r < block_list.size(); ++r)
+					num_skipped += min(data_size, (block_list[r].second + 1) * BOUND_BLOCK_SIZE)
+							- block_list[r].second * BOUND_BLOCK_SIZE;
+				break;
+			}
+			for (unsigned v = block_begin; v < block_end; ++v) {
+				if (oHeap.size() == aK && aK > 0
+						&& aNorm * mNormList[v] * (1 + tolerance) < -oHeap.front().first) {
+					num_skipped++;
+					continue;
+				}
+				double k = aID >= 0 ? Similarity(aID, v) : QuerySimilarity(aX, v);
+				PushTopK(oHeap, aK, make_pair(-k, v));
+				num_evaluated++;
+			}
+		}
+		#pragma omp atomic
+		mNumBoundEvaluated += num_evaluated;
+		#pragma omp atomic
+		mNumBoundSkipped += num_skipped;
+	}
+
+	bool IsBoundPruningActive() const {
+		return !mBlockNormList.empty();
+	}
+
+	void OutputBoundPruningStatistics() const {
+		if (mNumBoundEvaluated + mNumBoundSkipped == 0) return;
+		cout << "Bound pruning: " << mNumBoundEvaluated << " kernel evaluations, " << mNumBoundSkipped
+				<< " skipped (" << 100 * mNumBoundSkipped / (mNumBoundEvaluated + mNumBoundSkipped) << "%)"
+				<< endl;
+	}
+
+	///Inserts aItem in a max-heap that keeps the aK smallest (-kernel, id) pairs seen so far, i.e. the most
+	///similar instances with ties broken in favour of the smaller id
+	static inline void PushTopK(vector<pair<double, unsigned> >& aHeap, unsigned aK, const pair<double, unsigned>& aItem) {
+		if (aHeap.size() < aK) {
+			aHeap.push_back(aItem);
+			push_heap(aHeap.begin(), aHeap.end());
+		} else if (aK > 0 && aItem < aHeap.front()) {
+			pop_heap(aHeap.begin(), aHeap.end());
+			aHeap.back() = aItem;
+			push_heap(aHeap.begin(), aHeap.end());
+		}
+	}
+
+	///Computes for each instance in aIDList its aK truly most similar instances in the whole dataset as (-kernel,id)
+	///pairs sorted by decreasing similarity. Queries are distributed over threads; the kernel cache is not used.
+	void ComputeTrueKNN(const vector<unsigned>& aIDList, unsigned aK, vector<vector<pair<double, unsigned> > >& oKNNList) {
+		oKNNList.assign(aIDList.size(), vector<pair<double, unsigned> >());
+		ProgressBar progress_bar;
+		#pragma omp parallel for schedule(dynamic,1)
+		for (unsigned i = 0; i < aIDList.size(); ++i) {
+			unsigned u = aIDList[i];
+			vector<pair<double, unsigned> >& heap = oKNNList[i];
+			heap.reserve(aK);
+			if (IsBoundPruningActive()) BoundedTopK(u, aK, heap);
+			else
+				for (unsigned v = 0; v < mDataset.size(); v++)
+					PushTopK(heap, aK, make_pair(-Similarity(u, v), v)); //note: use -k to sort in decreasing order
+			sort_heap(heap.begin(), heap.end());
+			#pragma omp critical
+			progress_bar.Count();
+		}
+	}
+
+	///Computes the aK truly most similar instances of every instance in the dataset. The kernel matrix is
+	///processed in tiles and each kernel value of the upper triangle is computed once and offered to the
+	///heaps of both instances. Tiles are paired with a round robin schedule so that the tile pairs of one round
+	///touch disjoint heaps and can be processed in parallel; the result does not depend on the number of threads.
+	void ComputeAllTrueKNN(unsigned aK, vector<vector<pair<double, unsigned> > >& oKNNList) {
+		const unsigned TILE_SIZE = 256;
+		unsigned data_size = mDataset.size();
+		oKNNList.assign(data_size, vector<pair<double, unsigned> >());
+		for (unsigned i = 0; i < data_size; ++i)
+			oKNNList[i].reserve(aK);
+		unsigned num_tiles = (data_size + TILE_SIZE - 1) / TILE_SIZE;
+		//with an odd number of tiles add a dummy tile: the tile paired with it rests for that round
+		unsigned num_slots = num_tiles + num_tiles % 2;
+		ProgressBar progress_bar(1);
+		//round 0 processes the diagonal tiles, round r>0 processes the tile pairs of the circle method
+		for (unsigned round = 0; round < num_slots; ++round) {
+			vector<pair<unsigned, unsigned> > tile_pair_list;
+			if (round == 0) {
+				for (unsigned t = 0; t < num_tiles; ++t)
+					tile_pair_list.push_back(make_pair(t, t));
+			} else {
+				for (unsigned p = 0; p < num_slots / 2; ++p) {
+					unsigned a = p == 0 ? num_slots - 1 : (round - 1 + p) % (num_slots - 1);
+					unsigned b = (round - 1 + num_slots - 1 - p) % (num_slots - 1);
+					if (a < num_tiles && b < num_tiles) tile_pair_list.push_back(make_pair(min(a, b), max(a, b)));
+				}
+			}
+			#pragma omp parallel for schedule(dynamic,1)
+			for (unsigned p = 0; p < tile_pair_list.size(); ++p) {
+				unsigned tile_i = tile_pair_list[p].first;
+				unsigned tile_j = tile_pair_list[p].second;
+				unsigned i_end = min(data_size, (tile_i + 1) * TILE_SIZE);
+				unsigned j_end = min(data_size, (tile_j + 1) * TILE_SIZE);
+				for (unsigned u = tile_i * TILE_SIZE; u < i_end; ++u) {
+					unsigned j_begin = tile_i == tile_j ? u : tile_j * TILE_SIZE;
+					for (unsigned v = j_begin; v < j_end; ++v) {
+						double k_uv = Similarity(u, v);
+						PushTopK(oKNNList[u], aK, make_pair(-k_uv, v));
+						if (u != v) PushTopK(oKNNList[v], aK, make_pair(-k_uv, u));
+					}
+				}
+			}
 			progress_bar.Count();
 		}
+		#pragma omp parallel for schedule(dynamic,100)
+		for (unsigned i = 0; i < data_size; ++i)
+			sort_heap(oKNNList[i].begin(), oKNNList[i].end());
 	}
 
 	void OutputApproximateKNNPrediction(ostream& out,
@@ -1430,6 +3713,7 @@ public:
 		vector<string> train_target_list;
 		InputStringList(aTrainTargetInputFileName, train_target_list);
 
+		if (mInvertedIndex.empty()) ComputeInvertedIndex();
 		cout << "Computing k-NN predictions on " << test_dataset.size() << " instances." << endl;
 		//for each test instance
 		for (unsigned u = 0; u < test_dataset.size(); ++u) {
@@ -1468,20 +3752,109 @@ public:
 		return max_target;
 	}
 
+	///Computes the upper triangle of the kernel matrix in square tiles of GRAM_MATRIX_TILE_SIZE instances, so
+	///that the instances of a tile stay in cache while they are paired; tiles are distributed across threads and
+	///each value is computed once. Values bypass the kernel cache as none of them is requested twice. Tiles of
+	///the dataset matrix are computed with its batched product (in full for the tiles on the diagonal).
+	void ComputeKernelMatrix(GramMatrixClass& oMatrix) {
+		unsigned data_size = oMatrix.Size();
+		unsigned num_tiles = (data_size + GRAM_MATRIX_TILE_SIZE - 1) / GRAM_MATRIX_TILE_SIZE;
+		vector<pair<unsigned, unsigned> > tile_list;
+		for (unsigned ti = 0; ti < num_tiles; ++ti)
+			for (unsigned tj = ti; tj < num_tiles; ++tj)
+				tile_list.push_back(make_pair(ti, tj));
+		ProgressBar progress_bar;
+		#pragma omp parallel for schedule(dynamic,1)
+		for (unsigned t = 0; t < tile_list.size(); ++t) {
+			unsigned i_begin = tile_list[t].first * GRAM_MATRIX_TILE_SIZE;
+			unsigned i_end = min(data_size, i_begin + GRAM_MATRIX_TILE_SIZE);
+			unsigned j_begin = tile_list[t].second * GRAM_MATRIX_TILE_SIZE;
+			unsigned j_end = min(data_size, j_begin + GRAM_MATRIX_TILE_SIZE);
+			if (mSketchList.empty() && !mCompressedDataset.IsActive()) {
+				vector<SVectorView> query_list(mDatasetViewList.begin() + i_begin, mDatasetViewList.begin() + i_end);
+				vector<double> value_list;
+				mDatasetMatrix.Dot(query_list, j_begin, j_end, value_list);
+				for (unsigned i = i_begin; i < i_end; ++i)
+					for (unsigned j = max(i, j_begin); j < j_end; ++j)
+						oMatrix.Set(i, j, value_list[(i - i_begin) * (j_end - j_begin) + j - j_begin]);
+			} else {
+				for (unsigned i = i_begin; i < i_end; ++i)
+					for (unsigned j = max(i, j_begin); j < j_end; ++j)
+						oMatrix.Set(i, j, Similarity(i, j));
+			}
+			#pragma omp critical
+			progress_bar.Count();
+		}
+	}
+
+	///Computes the full rows [aBegin,aEnd) of the kernel matrix, stored row by row in oValueList; the columns are
+	///split in tiles of GRAM_MATRIX_TILE_SIZE instances that are distributed across threads
+	void ComputeKernelBand(unsigned aBegin, unsigned aEnd, vector<double>& oValueList) {
+		unsigned data_size = mDataset.size();
+		oValueList.resize((size_t) (aEnd - aBegin) * data_size);
+		unsigned num_tiles = (data_size + GRAM_MATRIX_TILE_SIZE - 1) / GRAM_MATRIX_TILE_SIZE;
+		#pragma omp parallel for schedule(dynamic,1)
+		for (unsigned t = 0; t < num_tiles; ++t) {
+			unsigned j_begin = t * GRAM_MATRIX_TILE_SIZE;
+			unsigned j_end = min(data_size, j_begin + GRAM_MATRIX_TILE_SIZE);
+			if (mSketchList.empty() && !mCompressedDataset.IsActive()) {
+				vector<SVectorView> query_list(mDatasetViewList.begin() + aBegin, mDatasetViewList.begin() + aEnd);
+				vector<double> value_list;
+				mDatasetMatrix.Dot(query_list, j_begin, j_end, value_list);
+				for (unsigned i = aBegin; i < aEnd; ++i)
+					for (unsigned j = j_begin; j < j_end; ++j)
+						oValueList[(size_t) (i - aBegin) * data_size + j] = value_list[(i - aBegin) * (j_end - j_begin) + j - j_begin];
+			} else {
+				for (unsigned i = aBegin; i < aEnd; ++i)
+					for (unsigned j = j_begin; j < j_end; ++j)
+						oValueList[(size_t) (i - aBegin) * data_size + j] = Similarity(i, j);
+			}
+		}
+	}
+
+	///Outputs the kernel matrix as text. Rows are computed and written one band of GRAM_MATRIX_TILE_SIZE rows
+	///at a time, so that memory stays linear in the dataset size.
 	void OutputKernel(ostream& out) {
 		cout << "Compute kernel matrix." << endl; ////
+		unsigned data_size = mDataset.size();
+		vector<double> value_list;
+		vector<string> line_list(GRAM_MATRIX_TILE_SIZE);
 		ProgressBar progress_bar;
-		for (unsigned i = 0; i < mDataset.size(); i++) {
-			for (unsigned j = 0; j < mDataset.size(); j++)
-				out << Kernel(i, j) << " ";
-			out << endl;
+		for (unsigned band_begin = 0; band_begin < data_size; band_begin += GRAM_MATRIX_TILE_SIZE) {
+			unsigned band_end = min(data_size, band_begin + GRAM_MATRIX_TILE_SIZE);
+			ComputeKernelBand(band_begin, band_end, value_list);
+			#pragma omp parallel for schedule(dynamic,1)
+			for (unsigned i = band_begin; i < band_end; ++i) {
+				stringstream ss;
+				for (unsigned j = 0; j < data_size; j++)
+					ss << value_list[(size_t) (i - band_begin) * data_size + j] << " ";
+				line_list[i - band_begin] = ss.str();
+			}
+			for (unsigned i = band_begin; i < band_end; ++i)
+				out << line_list[i - band_begin] << endl;
 			progress_bar.Count();
 		}
 	}
 
+	///Outputs the kernel matrix in the binary format of GramMatrixClass, in full or as the packed upper triangle
+	void OutputBinaryKernel(const string& aFileName) {
+		cout << "Compute kernel matrix." << endl; ////
+		bool is_triangular = PARAM_OBJ.mKernelMatrixFormat == "triangular";
+		GramMatrixClass matrix;
+		if (PARAM_OBJ.mKernelMatrixMemoryMap) matrix.Init(mDataset.size(), is_triangular, aFileName);
+		else matrix.Init(mDataset.size(), is_triangular);
+		ComputeKernelMatrix(matrix);
+		if (!PARAM_OBJ.mKernelMatrixMemoryMap) {
+			ofstream ofs(aFileName.c_str(), ios::binary);
+			if (!ofs) throw range_error("ERROR:Cannot open file:" + aFileName);
+			matrix.Save(ofs);
+		}
+		matrix.Close();
+	}
+
 	void Output(ostream& out) {
 		for (unsigned i = 0; i < mDataset.size(); i++)
-			out << mDataset[i];
+			out << Instance(i);
 	}
 
 	void OutputFeatureMap(string aFileName) const {
@@ -1497,41 +3870,108 @@ public:
 		}
 	}
 
+	void InitKernelCache() {
+		double data_size = mDataset.size();
+		mKernelCache.Init(data_size * (data_size + 1) / 2, PARAM_OBJ.mKernelCacheMemory * 1048576);
+		if (PARAM_OBJ.mSharedNeighbourhood)
+			mSharedNeighborhoodCache.Init(data_size * (data_size + 1) / 2,
+					PARAM_OBJ.mKernelCacheMemory * 1048576);
+	}
+
+	void OutputKernelCacheStatistics() const {
+		if (PARAM_OBJ.mCaching) {
+			mKernelCache.OutputStatistics(cout, "Kernel");
+			if (PARAM_OBJ.mSharedNeighbourhood)
+				mSharedNeighborhoodCache.OutputStatistics(cout, "Shared neighborhood similarity");
+		}
+	}
+
 	double Kernel(unsigned aI, unsigned aJ) {
 		unsigned i = min(aI, aJ);
 		unsigned j = max(aI, aJ);
 		if (PARAM_OBJ.mCaching) {
-			pair<unsigned, unsigned> key = make_pair(i, j);
-			if (mKernelMap.count(key) == 0) {
-				double value = Similarity(i, j);
-				mKernelMap[key] = value;
+			double value = 0;
+			if (!mKernelCache.Get(i, j, value)) {
+				value = Similarity(i, j);
+				mKernelCache.Put(i, j, value);
 			}
-			return mKernelMap[key];
+			return value;
 		} else return Similarity(i, j);
 	}
 
 	double Similarity(unsigned aI, unsigned aJ) {
-		return dot(mDataset[aI], mDataset[aJ]);
+		if (!mSketchList.empty()) return SketchSimilarity(aI, aJ);
+		if (mCompressedDataset.IsActive()) return mCompressedDataset.Dot(aI, aJ);
+		return dot(mDatasetViewList[aI], mDatasetViewList[aJ]);
+	}
+
+	///Estimates the similarity of two instances as the fraction of equal signature values (i.e. of bins they
+	///share, including the ones dropped for being oversized); for min-hash signatures this is an unbiased
+	///estimate of the Jaccard similarity (of the probability that all rows of a band agree in banded mode)
+	double SketchSimilarity(unsigned aI, unsigned aJ) const {
+		const vector<unsigned>& signature_i = mSketchList[aI];
+		const vector<unsigned>& signature_j = mSketchList[aJ];
+		unsigned num_equal = 0;
+		for (unsigned k = 0; k < signature_i.size(); ++k)
+			if (signature_i[k] == signature_j[k]) num_equal++;
+		return (double) num_equal / (double) signature_i.size();
 	}
 	/**
 	 Computes the fraction of neighbors that are common between instance I and J
 	 */
 	double ComputeSharedNeighborhoodSimilarity(unsigned aI, unsigned aJ) {
-		//TODO: cache this result
-		vector<unsigned> neighborhood_i = ComputeApproximateNeighborhood(aI);
-		vector<unsigned> neighborhood_j = ComputeApproximateNeighborhood(aJ);
-		set<unsigned> neighborhood_i_set;
-		neighborhood_i_set.insert(neighborhood_i.begin(), neighborhood_i.end());
-		set<unsigned> neighborhood_j_set;
-		neighborhood_j_set.insert(neighborhood_j.begin(), neighborhood_j.end());
-		set<unsigned> intersection;
-		set_intersection(neighborhood_i_set.begin(), neighborhood_i_set.end(),
-				neighborhood_j_set.begin(), neighborhood_j_set.end(),
-				inserter(intersection, intersection.begin()));
-		double shared_neighbourhood_value = (double) intersection.size()
-				/ sqrt((double) neighborhood_i_set.size() * (double) neighborhood_j_set.size());
+		unsigned i = min(aI, aJ);
+		unsigned j = max(aI, aJ);
+		if (PARAM_OBJ.mCaching) {
+			double value = 0;
+			if (!mSharedNeighborhoodCache.Get(i, j, value)) {
+				value = CoreComputeSharedNeighborhoodSimilarity(i, j);
+				mSharedNeighborhoodCache.Put(i, j, value);
+			}
+			return value;
+		} else return CoreComputeSharedNeighborhoodSimilarity(i, j);
+	}
+
+	double CoreComputeSharedNeighborhoodSimilarity(unsigned aI, unsigned aJ) {
+		const vector<unsigned>& neighborhood_i = GetSortedApproximateNeighborhood(aI);
+		const vector<unsigned>& neighborhood_j = GetSortedApproximateNeighborhood(aJ);
+		//merge the two sorted lists counting the common ids
+		unsigned intersection_size = 0;
+		vector<unsigned>::const_iterator it_i = neighborhood_i.begin();
+		vector<unsigned>::const_iterator it_j = neighborhood_j.begin();
+		while (it_i != neighborhood_i.end() && it_j != neighborhood_j.end()) {
+			if (*it_i < *it_j) ++it_i;
+			else if (*it_j < *it_i) ++it_j;
+			else {
+				intersection_size++;
+				++it_i;
+				++it_j;
+			}
+		}
+		double shared_neighbourhood_value = (double) intersection_size
+				/ sqrt((double) neighborhood_i.size() * (double) neighborhood_j.size());
 		return shared_neighbourhood_value;
 	}
+
+	///Returns the approximate neighborhood of an instance as a list of distinct ids in increasing order; the
+	///reference stays valid as elements of the cache are never erased
+	const vector<unsigned>& GetSortedApproximateNeighborhood(unsigned aID) {
+		//NOTE: iterators are invalidated by a rehash in another thread, references to the nodes are not, hence
+		//only pointers to the cached values leave the critical sections
+		const vector<unsigned>* sorted_neighborhood = NULL;
+		#pragma omp critical(sorted_neighborhood_cache)
+		{
+			umap_uint_vec_uint::const_iterator it = mSortedNeighborhoodMap.find(aID);
+			if (it != mSortedNeighborhoodMap.end()) sorted_neighborhood = &it->second;
+		}
+		if (sorted_neighborhood != NULL) return *sorted_neighborhood;
+		vector<unsigned> neighborhood = ComputeApproximateNeighborhood(aID);
+		sort(neighborhood.begin(), neighborhood.end());
+		neighborhood.erase(unique(neighborhood.begin(), neighborhood.end()), neighborhood.end());
+		#pragma omp critical(sorted_neighborhood_cache)
+		sorted_neighborhood = &mSortedNeighborhoodMap.insert(make_pair(aID, neighborhood)).first->second;
+		return *sorted_neighborhood;
+	}
 }
 ;
 
@@ -1541,7 +3981,6 @@ int main(int argc, char** argv) {
 	LOGF << "--------------------------------------------------------------------------------"
 			<< endl;
 	LOGF << CREDITS << " \nLast build:" << DATE << endl;
-	cout << CREDITS << " \nLast build:" << DATE << endl;
 	time_t rawtime_start;
 	time(&rawtime_start);
 	LOGF << "Start logging: " << asctime(localtime(&rawtime_start)) << endl;
@@ -1551,6 +3990,10 @@ int main(int argc, char** argv) {
 	LOGF << endl;
 	try {
 		PARAM_OBJ.Init(argc, argv);
+		//when queries are answered on stdout all the other messages are diverted to stderr
+		ostream query_out(cout.rdbuf());
+		if (PARAM_OBJ.mServe && PARAM_OBJ.mSocketFileName == "") cout.rdbuf(cerr.rdbuf());
+		cout << CREDITS << " \nLast build:" << DATE << endl;
 		srand(PARAM_OBJ.mRandSeed);
 		string mode = "";
 		//factory
@@ -1600,17 +4043,28 @@ int main(int argc, char** argv) {
 
 		//read data
 		C.Input();
+		if (PARAM_OBJ.mOutputApproximateCluster) C.FilterBinDataStructure();
+		if (PARAM_OBJ.mCaching) C.InitKernelCache();
+		if (PARAM_OBJ.mKNNGraphFileName != "") C.PrepareKNNGraph();
+		if (PARAM_OBJ.mBoundPruning) C.PrepareBoundPruning();
 
 		if (PARAM_OBJ.mOutputFeatures) {
 			if (PARAM_OBJ.mOutputFeatureMap) C.OutputFeatureMap(PARAM_OBJ.mGspanInputFileName);
 		}
 
 		if (PARAM_OBJ.mOutputApproximateCluster) {
-			C.OutputApproximateCluster();
+			if (PARAM_OBJ.mVerbose) C.OutputBinDataStructureStatistics();
+			ofname = PARAM_OBJ.mGspanInputFileName + PARAM_OBJ.mSparseASCIIInputFileName
+					+ PARAM_OBJ.mSparseBinaryInputFileName + ".fast_cluster";
+			string ofname2 = PARAM_OBJ.mGspanInputFileName + PARAM_OBJ.mSparseASCIIInputFileName
+					+ PARAM_OBJ.mSparseBinaryInputFileName + ".fast_cluster_sim";
+			ofstream ofs_fc(ofname.c_str());
+			ofstream ofs_fc2(ofname2.c_str());
+			C.OutputApproximateCluster(ofs_fc, ofs_fc2);
 		}
 
 		if (PARAM_OBJ.mOutputCluster) {
-			C.ComputeBinDataStructure();
+			C.PrepareBinDataStructure();
 			if (PARAM_OBJ.mVerbose) C.OutputBinDataStructureStatistics();
 			ofname = PARAM_OBJ.mGspanInputFileName + PARAM_OBJ.mSparseASCIIInputFileName
 					+ PARAM_OBJ.mSparseBinaryInputFileName + ".fast_cluster";
@@ -1623,7 +4077,7 @@ int main(int argc, char** argv) {
 		}
 
 		if (PARAM_OBJ.mOutputAccuracy) {
-			C.ComputeBinDataStructure();
+			C.PrepareBinDataStructure();
 			ofname = PARAM_OBJ.mGspanInputFileName + PARAM_OBJ.mSparseASCIIInputFileName
 					+ PARAM_OBJ.mSparseBinaryInputFileName + ".nn_accuracy";
 			ofstream ofs_fc(ofname.c_str());
@@ -1631,7 +4085,7 @@ int main(int argc, char** argv) {
 		}
 
 		if (PARAM_OBJ.mOutputApproximateKNN) {
-			C.ComputeBinDataStructure();
+			C.PrepareBinDataStructure();
 			ofname = PARAM_OBJ.mGspanInputFileName + PARAM_OBJ.mSparseASCIIInputFileName
 					+ PARAM_OBJ.mSparseBinaryInputFileName + ".approx_knn";
 			string ofname2 = PARAM_OBJ.mGspanInputFileName + PARAM_OBJ.mSparseASCIIInputFileName
@@ -1653,15 +4107,25 @@ int main(int argc, char** argv) {
 			C.OutputTrueKNN(ofs_fknn,ofs_knn_sim);
 		}
 
+		if (PARAM_OBJ.mAllPairsThreshold > 0 && !PARAM_OBJ.mOutputApproximateCluster) {
+			ofname = PARAM_OBJ.mGspanInputFileName + PARAM_OBJ.mSparseASCIIInputFileName
+					+ PARAM_OBJ.mSparseBinaryInputFileName + ".all_pairs";
+			ofstream ofs_ap(ofname.c_str(), ios::binary);
+			if (!ofs_ap) throw range_error("Cannot open file:" + ofname);
+			C.OutputAllPairs(ofs_ap);
+		}
+
 		if (PARAM_OBJ.mOutputKernel) {
 			ofname = PARAM_OBJ.mGspanInputFileName + PARAM_OBJ.mSparseASCIIInputFileName
 					+ PARAM_OBJ.mSparseBinaryInputFileName + ".kernel";
-			ofstream ofs_fk(ofname.c_str());
-			C.OutputKernel(ofs_fk);
+			if (PARAM_OBJ.mKernelMatrixFormat == "text") {
+				ofstream ofs_fk(ofname.c_str());
+				C.OutputKernel(ofs_fk);
+			} else C.OutputBinaryKernel(ofname + ".bin");
 		}
 
 		if (PARAM_OBJ.mOutputApproximateKNNPrediction) {
-			C.ComputeBinDataStructure();
+			C.PrepareBinDataStructure();
 			ofname = PARAM_OBJ.mGspanInputFileName + PARAM_OBJ.mSparseASCIIInputFileName
 					+ PARAM_OBJ.mSparseBinaryInputFileName + ".approx_knn_prediction";
 			ofstream ofs_knnp(ofname.c_str());
@@ -1677,6 +4141,16 @@ int main(int argc, char** argv) {
 					PARAM_OBJ.mTrainTargetInputFileName);
 		}
 
+		if (PARAM_OBJ.mServe) {
+			C.PrepareBinDataStructure();
+			if (PARAM_OBJ.mSocketFileName != "") C.ServeSocket(PARAM_OBJ.mSocketFileName);
+			else C.ServeQueries(cin, query_out);
+		}
+
+		C.OutputCandidateStatistics();
+		C.OutputKernelCacheStatistics();
+		C.OutputBoundPruningStatistics();
+
 	} catch (exception& e) {
 		cerr << e.what();
 		LOGF << e.what() << endl;
@@ -224,7 +224,7 @@ void NSPDK_FeatureGenerator::GenerateFeatures(const GraphClass& aG, int aDistanc
 	src_feature=mSubgraphEncodingCache[radius_src_id];
       }
       if (aDistance>0) {
-	vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
+	const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
 	for (unsigned dest_j=0;dest_j<dest_id_list.size();dest_j++){
 	  unsigned dest_id=dest_id_list[dest_j];
 	  if (aG.GetVertexKernelPoint(dest_id) && aG.GetVertexAlive(dest_id)){//proceed to extract features only if the *dest* vertex is a kernel point and is alive
@@ -351,7 +351,7 @@ unsigned NSPDK_FeatureGenerator::HardEncoding(int aRootVertexIndex, const GraphC
     //extract set of vertices in the ball of radius aMaxDepth
     set<unsigned> ball;
     for (int r=0;r<=aRadius;r++) {
-      vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
+      const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
       ball.insert(dest_id_list.begin(),dest_id_list.end());
     }
 
@@ -475,7 +475,7 @@ unsigned NSPDK_FeatureGenerator::RadiusKRootedGraphCanonicalFormEncoding(int aRo
   //extract set of vertices in the ball of radius aMaxDepth
     set<unsigned> ball;
     for (int r=0;r<=aRadius;r++) {
-      vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
+      const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
       ball.insert(dest_id_list.begin(),dest_id_list.end());
     }
 
@@ -537,7 +537,7 @@ SecondOrderHistogramClass NSPDK_FeatureGenerator::RadiusKRootedGraphCanonicalFor
     //extract set of vertices in the ball of radius aRadius
     set<unsigned> ball;
     for (int r=0;r<=aRadius;r++) {
-      vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
+      const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
       ball.insert(dest_id_list.begin(),dest_id_list.end());
     }
 
@@ -596,7 +596,7 @@ unsigned ANSPDK_FeatureGenerator::RadiusKRootedGraphCanonicalFormEncoding(int aR
   //extract set of vertices in the ball of radius aMaxDepth
     set<unsigned> ball;
     for (int r=0;r<=aRadius;r++) {
-      vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
+      const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
       ball.insert(dest_id_list.begin(),dest_id_list.end());
     }
     //for all vertices in ball extract the vertex's signature: distance from root-sorted distance from all the other vertices + their vertex label
@@ -674,7 +674,7 @@ SecondOrderHistogramClass ANSPDK_FeatureGenerator::RadiusKRootedGraphCanonicalFo
     //extract set of vertices in the ball of radius aRadius
     set<unsigned> ball;
     for (int r=0;r<=aRadius;r++) {
-      vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
+      const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
       ball.insert(dest_id_list.begin(),dest_id_list.end());
     }
 
@@ -726,7 +726,7 @@ void NSPDK3D_FeatureGenerator::GenerateFeatures(const GraphClass& aG, int aDista
     for (unsigned i=0;i<aFirstEndpointList.size();i++){
       unsigned src_id=aFirstEndpointList[i];
       if (aG.GetVertexKernelPoint(src_id) && aG.GetVertexAlive(src_id)){
-	vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
+	const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
 	for (unsigned dest_j=0;dest_j<dest_id_list.size();dest_j++){
 	  unsigned dest_id=dest_id_list[dest_j];
 	  if (aG.GetVertexKernelPoint(dest_id) && aG.GetVertexAlive(dest_id) ){
@@ -785,7 +785,7 @@ vector<double> NSPDK3D_FeatureGenerator::GetRootDirection(int aRootVertexIndex,
     //extract set of vertices in the ball of radius aRadius, except the root (hence radius starts from 1)
     set<unsigned> ball;
     for (int r=1;r<=aRadius;r++) {
-      vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
+      const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(aRootVertexIndex,r);
       ball.insert(dest_id_list.begin(),dest_id_list.end());
     }
     //compute average vertex-root direction
@@ -896,7 +896,7 @@ void ALNSPDK_FeatureGenerator::GenerateFeatures(const GraphClass& aG, int aDista
     for (unsigned i=0;i<aFirstEndpointList.size();i++){
       unsigned src_id=aFirstEndpointList[i];
       if (aG.GetVertexKernelPoint(src_id) && aG.GetVertexAlive(src_id)){//proceed to extract features only if the *src* vertex is a kernel point
-	vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
+	const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
 	for (unsigned dest_j=0;dest_j<dest_id_list.size();dest_j++){
 	  unsigned dest_id=dest_id_list[dest_j];
 	  if (aG.GetVertexKernelPoint(dest_id) && aG.GetVertexAlive(dest_id)){//proceed to extract features only if the *dest* vertex is a kernel point
@@ -961,7 +961,7 @@ void GNSPDK_FeatureGenerator::GenerateFeatures(const GraphClass& aG, int aDistan
     for (unsigned i=0;i<aFirstEndpointList.size();i++){
       unsigned src_id=aFirstEndpointList[i];
       if (aG.GetVertexKernelPoint(src_id) && aG.GetVertexAlive(src_id)){//proceed to extract features only if the *src* vertex is a kernel point and is alive
-	vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
+	const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
 	for (unsigned dest_j=0;dest_j<dest_id_list.size();dest_j++){
 	  unsigned dest_id=dest_id_list[dest_j];
 	  if (aG.GetVertexKernelPoint(dest_id) && aG.GetVertexAlive(dest_id)){//proceed to extract features only if the *dest* vertex is a kernel point and is alive
@@ -1066,7 +1066,7 @@ void MNSPDK_FeatureGenerator::GenerateFeatures(const GraphClass& aG, int aDistan
 	src_feature=mMemoizedSubgraphEncodingCache[graph_id][aRadius][src_id];
       }
       if (aDistance>0) {
-	vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
+	const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,aDistance);
 	for (unsigned dest_j=0;dest_j<dest_id_list.size();dest_j++){
 	  unsigned dest_id=dest_id_list[dest_j];
 	  if (aG.GetVertexKernelPoint(dest_id) && aG.GetVertexAlive(dest_id)){//proceed to extract features only if the *dest* vertex is a kernel point
@@ -1145,7 +1145,7 @@ void USTPNSPDK_FeatureGenerator::generate_feature_vector(const GraphClass& aG, S
     unsigned src_id=first_endpoint_list[i];
     SVector z_vertex;
     for (unsigned dt=mThicknessDistance;dt>1; dt--){
-      vector<unsigned> dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,dt);
+      const vector<unsigned>& dest_id_list=aG.GetFixedDistanceVertexIDList(src_id,dt);
       for (unsigned j=0;j<dest_id_list.size();j++){
 	unsigned dest_id=dest_id_list[j];
 	SVector z_distance;
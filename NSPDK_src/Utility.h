@@ -61,6 +61,40 @@ inline int IntHash(int key, int aModulo, unsigned aSeed){
   return IntHashSimple(key*(aSeed+1)*A,aModulo);
 }
 
+///Return a 64 bit hash value that is a deterministic function of a key, a seed and a stream index
+inline unsigned long long HashMix(unsigned aKey, unsigned aSeed, unsigned aStream){
+  unsigned long long z=(((unsigned long long)aKey<<32) | aSeed) + 0x9E3779B97F4A7C15ULL*(aStream+1);
+  z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+  z=(z^(z>>27))*0x94D049BB133111EBULL;
+  return z^(z>>31);
+}
+
+///Return a pseudo random number in the open interval (0,1) that is a deterministic function of a key, a seed and a stream index
+inline double HashUnit(unsigned aKey, unsigned aSeed, unsigned aStream){
+  return ((double)(HashMix(aKey,aSeed,aStream)>>11)+.5)/9007199254740992.0;//NOTE: 53 bits of precision
+}
+
+///Pseudo random number generator with its own state, to draw reproducible sequences from parallel code where the global rand() cannot be shared
+class RandomGeneratorClass{
+public:
+  RandomGeneratorClass(unsigned aSeed, unsigned aStream):mState(HashMix(aSeed,aStream,0)){}
+  ///Returns a random integer between 0 and the argument aMax
+  unsigned Unsigned(unsigned aMax){
+    unsigned long long z=(mState+=0x9E3779B97F4A7C15ULL);
+    z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+    z=(z^(z>>27))*0x94D049BB133111EBULL;
+    return (unsigned)((z^(z>>31)) % aMax);
+  }
+private:
+  unsigned long long mState;
+};
+
+///Adapter that draws from the global rand() with the same interface as RandomGeneratorClass
+class GlobalRandomGeneratorClass{
+public:
+  unsigned Unsigned(unsigned aMax){return randomUnsigned(aMax);}
+};
+
 unsigned RSHash(const string& str);
 unsigned RSHash(const vector<unsigned>& aV);
 unsigned APHash(const string& str);
@@ -27,6 +27,7 @@
 #include <iostream>
 #include <cassert>
 #include <cctype>
+#include <algorithm>
 
 namespace
 {
@@ -880,9 +881,13 @@ SVector::load(std::istream &f)
 double 
 dot(const FVector &v1, const FVector &v2)
 {
-  int m = min(v1.size(), v2.size());
-  const VFloat *f1 = v1;
-  const VFloat *f2 = v2;
+  return dot((const VFloat*)v1, (const VFloat*)v2, min(v1.size(), v2.size()));
+}
+
+
+double 
+dot(const VFloat *f1, const VFloat *f2, int m)
+{
   VFloat sum = 0.0;
 #if defined(__GNUC__) && defined(__SSE2__) && !defined(__APPLE__)
   typedef float v4sf __attribute__ ((vector_size (16)));
@@ -937,14 +942,31 @@ dot(const SVector &v1, const FVector &v2)
 }
 
 
-double 
-dot(const SVector &v1, const SVector &v2)
+// Sparse dot product kernels.
+// They only differ in the way they find the matching indices: all of
+// them add the double precision products of the matching coefficients
+// in increasing index order, hence they return bit-identical results.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+# define VECTORS_SIMD_DOT 1
+# include <immintrin.h>
+#endif
+
+namespace
 {
-  const SVector::Pair *p1 = v1;
-  const SVector::Pair *p2 = v2;
-  double sum = 0;
-  if (p1 && p2)
-    while (p1->i >= 0 && p2->i >= 0)
+  typedef double (*sparse_dot_t)(const SVector::Pair *p1, int n1,
+                                 const SVector::Pair *p2, int n2);
+
+  // lists whose lengths differ more than this are intersected by galloping
+  const int GALLOP_RATIO = 16;
+
+  // scalar merge of the remaining pairs of both lists
+  inline double
+  sparse_dot_merge(const SVector::Pair *p1, const SVector::Pair *e1,
+                   const SVector::Pair *p2, const SVector::Pair *e2,
+                   double sum)
+  {
+    while (p1 < e1 && p2 < e2)
       {
         if (p1->i < p2->i)
           p1++;
@@ -953,7 +975,196 @@ dot(const SVector &v1, const SVector &v2)
         else
           sum += (double)(p1++)->v * (double)(p2++)->v;
       }
-  return sum;
+    return sum;
+  }
+
+#if ! VECTORS_SIMD_DOT
+  double
+  sparse_dot_scalar(const SVector::Pair *p1, int n1,
+                    const SVector::Pair *p2, int n2)
+  {
+    return sparse_dot_merge(p1, p1 + n1, p2, p2 + n2, 0);
+  }
+#endif
+
+  inline bool
+  pair_index_less(const SVector::Pair &p, int i)
+  {
+    return p.i < i;
+  }
+
+  // looks up each pair of the short list p1 in the long list p2 with an
+  // exponential search followed by a binary search
+  double
+  sparse_dot_gallop(const SVector::Pair *p1, int n1,
+                    const SVector::Pair *p2, int n2)
+  {
+    const SVector::Pair *e1 = p1 + n1;
+    const SVector::Pair *e2 = p2 + n2;
+    double sum = 0;
+    for (; p1 < e1 && p2 < e2; p1++)
+      {
+        int bound = 1;
+        while (bound < e2 - p2 && p2[bound].i < p1->i)
+          bound *= 2;
+        p2 = std::lower_bound(p2 + bound / 2, p2 + min((int)(e2 - p2), bound + 1),
+                              p1->i, pair_index_less);
+        if (p2 < e2 && p2->i == p1->i)
+          sum += (double)p1->v * (double)(p2++)->v;
+      }
+    return sum;
+  }
+
+#if VECTORS_SIMD_DOT
+  // adds the products of the pairs of block b1 flagged in mask with
+  // their match in block b2, in increasing index order
+  inline double
+  sparse_dot_block_matches(const SVector::Pair *b1, const SVector::Pair *b2,
+                           int width, unsigned mask, double sum)
+  {
+    for (int k = 0; mask; k++, mask >>= 1)
+      if (mask & 1)
+        for (int j = 0; j < width; j++)
+          if (b2[j].i == b1[k].i)
+            {
+              sum += (double)b1[k].v * (double)b2[j].v;
+              break;
+            }
+    return sum;
+  }
+
+  // gathers the indices of 4 consecutive pairs
+  inline __m128i
+  load_indices_sse2(const SVector::Pair *p)
+  {
+    __m128 lo = _mm_loadu_ps((const float*)p);
+    __m128 hi = _mm_loadu_ps((const float*)(p + 2));
+    return _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2,0,2,0)));
+  }
+
+  // compares blocks of 4 indices of each list all against all
+  double
+  sparse_dot_sse2(const SVector::Pair *p1, int n1,
+                  const SVector::Pair *p2, int n2)
+  {
+    const SVector::Pair *e1 = p1 + n1;
+    const SVector::Pair *e2 = p2 + n2;
+    double sum = 0;
+    while (e1 - p1 >= 4 && e2 - p2 >= 4)
+      {
+        __m128i a = load_indices_sse2(p1);
+        __m128i b = load_indices_sse2(p2);
+        __m128i eq = _mm_cmpeq_epi32(a, b);
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(0,3,2,1))));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(1,0,3,2))));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(2,1,0,3))));
+        unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        if (mask)
+          sum = sparse_dot_block_matches(p1, p2, 4, mask, sum);
+        int max1 = p1[3].i;
+        int max2 = p2[3].i;
+        if (max1 <= max2)
+          p1 += 4;
+        if (max2 <= max1)
+          p2 += 4;
+      }
+    return sparse_dot_merge(p1, e1, p2, e2, sum);
+  }
+
+  // gathers the indices of 8 consecutive pairs
+  __attribute__((target("avx2"))) inline __m256i
+  load_indices_avx2(const SVector::Pair *p)
+  {
+    const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256i lo = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)p), even);
+    __m256i hi = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(p + 4)), even);
+    return _mm256_permute2x128_si256(lo, hi, 0x20);
+  }
+
+  // compares blocks of 8 indices of each list all against all
+  __attribute__((target("avx2"))) double
+  sparse_dot_avx2(const SVector::Pair *p1, int n1,
+                  const SVector::Pair *p2, int n2)
+  {
+    const SVector::Pair *e1 = p1 + n1;
+    const SVector::Pair *e2 = p2 + n2;
+    const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    double sum = 0;
+    while (e1 - p1 >= 8 && e2 - p2 >= 8)
+      {
+        __m256i a = load_indices_avx2(p1);
+        __m256i b = load_indices_avx2(p2);
+        __m256i eq = _mm256_cmpeq_epi32(a, b);
+        for (int r = 1; r < 8; r++)
+          {
+            b = _mm256_permutevar8x32_epi32(b, rotate);
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(a, b));
+          }
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        if (mask)
+          sum = sparse_dot_block_matches(p1, p2, 8, mask, sum);
+        int max1 = p1[7].i;
+        int max2 = p2[7].i;
+        if (max1 <= max2)
+          p1 += 8;
+        if (max2 <= max1)
+          p2 += 8;
+      }
+    return sparse_dot_merge(p1, e1, p2, e2, sum);
+  }
+#endif
+
+  // picks the widest kernel supported by the cpu we are running on
+  sparse_dot_t
+  select_sparse_dot()
+  {
+#if VECTORS_SIMD_DOT
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return sparse_dot_avx2;
+    return sparse_dot_sse2;
+#else
+    return sparse_dot_scalar;
+#endif
+  }
+
+  const sparse_dot_t sparse_dot_block = select_sparse_dot();
+}
+
+double 
+dot(const SVector &v1, const SVector &v2)
+{
+  const SVector::Pair *p1 = v1;
+  const SVector::Pair *p2 = v2;
+  if (! (p1 && p2))
+    return 0;
+  return dot(p1, v1.npairs(), p2, v2.npairs());
+}
+
+double 
+dot(const SVectorView &v1, const SVectorView &v2)
+{
+  const SVector::Pair *p1 = v1;
+  const SVector::Pair *p2 = v2;
+  if (! (p1 && p2))
+    return 0;
+  return dot(p1, v1.npairs(), p2, v2.npairs());
+}
+
+double 
+dot(const SVector::Pair *p1, int n1, const SVector::Pair *p2, int n2)
+{
+  // products are commutative, so the short list can go first
+  if (n1 > n2)
+    {
+      std::swap(p1, p2);
+      std::swap(n1, n2);
+    }
+  if (n1 == 0)
+    return 0;
+  if ((double)n1 * GALLOP_RATIO < n2)
+    return sparse_dot_gallop(p1, n1, p2, n2);
+  return sparse_dot_block(p1, n1, p2, n2);
 }
 
 
@@ -161,10 +161,31 @@ public:
                          const SVector &v2, double a2);
 };
 
+// Non-owning view of the pairs of a SVector. It does not touch the
+// reference count, so it is cheap to copy and can be handed to other
+// threads, as long as the viewed vector outlives it and is not modified.
+class SVectorView
+{
+public:
+  SVectorView() : p(0), n(0) {}
+  SVectorView(const SVector &v) : p(v), n(v.npairs()) {}
+  SVectorView(const SVector::Pair *pairs, int npairs) : p(pairs), n(npairs) {}
+  int npairs() const { return n; }
+  operator const SVector::Pair* () const { return p; }
+private:
+  const SVector::Pair *p;
+  int n;
+};
+
 double dot(const FVector &v1, const FVector &v2);
+// dot product of two dense arrays of n values (16 byte aligned)
+double dot(const VFloat *f1, const VFloat *f2, int n);
 double dot(const FVector &v1, const SVector &v2);
 double dot(const SVector &v1, const FVector &v2);
 double dot(const SVector &v1, const SVector &v2);
+// dot product of two arrays of pairs sorted by increasing index
+double dot(const SVector::Pair *p1, int n1, const SVector::Pair *p2, int n2);
+double dot(const SVectorView &v1, const SVectorView &v2);
 
 SVector combine(const SVector &v1, double a1, const SVector &v2, double a2);
 FVector combine(const FVector &v1, double a1, const SVector &v2, double a2);
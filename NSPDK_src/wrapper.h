@@ -26,13 +26,31 @@
 #define WRAPPER_H 1
 
 
+// The reference count is updated atomically, so that wrappers sharing
+// the same representation can be copied and destroyed concurrently
+// (e.g. from different OpenMP threads). Mutating a shared object from
+// several threads still requires external synchronisation.
+// With C++11 wrappers can also be moved without touching the reference
+// count nor allocating. The moved-from wrapper holds no representation:
+// it reads as a shared static default one and gets its own on detach().
+
+#if defined(__GNUC__)
+# define WRAPPER_ATOMIC_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+# define WRAPPER_ATOMIC_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+# define WRAPPER_ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#else
+# define WRAPPER_ATOMIC_INC(x) (++(x))
+# define WRAPPER_ATOMIC_DEC(x) (--(x))
+# define WRAPPER_ATOMIC_LOAD(x) (x)
+#endif
+
 template <class Rep> 
 class Wrapper
 {
  private:
   Rep *q;
-  Rep *ref(Rep *q) { q->refcount++; return q; }
-  void deref(Rep *q) { if (! --(q->refcount)) delete q; }
+  Rep *ref(Rep *q) { if (q) WRAPPER_ATOMIC_INC(q->refcount); return q; }
+  void deref(Rep *q) { if (q && ! WRAPPER_ATOMIC_DEC(q->refcount)) delete q; }
   
  public:
   Wrapper() 
@@ -41,14 +59,27 @@ class Wrapper
     : q(rep) { q->refcount = 1; }
   Wrapper(const Wrapper<Rep> &other) 
     : q(ref(other.q)) {}
+#if __cplusplus >= 201103L
+  Wrapper(Wrapper<Rep> &&other)
+    : q(other.q) { other.q = 0; }
+  Wrapper& operator=(Wrapper<Rep> &&other)
+    { if (this != &other) { Rep *p = q; q = other.q; other.q = 0; deref(p); } return *this; }
+#endif
   ~Wrapper() 
     { deref(q); }
   Wrapper& operator=(const Wrapper<Rep> &other) 
     { Rep *p = q; q = ref(other.q); deref(p); return *this; }
   void detach() 
-    { if (q->refcount > 1) { deref(q); q=q->copy(); q->refcount=1; } }
+    { if (! q) { q = empty()->copy(); q->refcount = 1; }
+      else if (WRAPPER_ATOMIC_LOAD(q->refcount) > 1) { Rep *p = q; q = p->copy(); q->refcount = 1; deref(p); } }
   Rep *rep() const
-    { return q; }
+    { return q ? q : empty(); }
+ private:
+  // read-only stand-in for the missing representation of a moved-from
+  // wrapper, shared and never freed; copy() turns a bare Rep into a well
+  // formed empty one (e.g. with the terminator of an SVector)
+  static Rep *empty()
+    { static Rep *e = Rep().copy(); return e; }
 };
 
 